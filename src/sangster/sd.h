@@ -33,12 +33,16 @@
  * (C) Copyright 2010 SparkFun Electronics
  */
 
+#include <ctype.h>
 #include <stdbool.h>
 #include "sangster/api.h"
 #include "sangster/pinout.h"
 #include "sangster/sd/sd_card.h"
 #include "sangster/sd/sd_file.h"
 #include "sangster/sd/sd_volume.h"
+#ifdef SD_SNAPSHOT
+#include "sangster/sd/sd_snapshot.h"
+#endif
 
 
 /*******************************************************************************
@@ -52,6 +56,28 @@
 #define PATH_COMPONENT_BUFFER_LEN (MAX_COMPONENT_LEN + 1)
 #define RETURN_ERR_FILE do { SdFile err; sd_file_init(&err); return err; }while(0)
 
+// SdClass errors, see sd_open_file()
+/** no error */
+#define SD_ERROR_NONE 0
+
+/** a directory in the path does not exist */
+#define SD_ERROR_NO_PATH 0x1
+
+/** the file does not exist or can't be opened with the mode given */
+#define SD_ERROR_OPEN 0x2
+
+/** all SD_MAX_OPEN_FILES handles are open */
+#define SD_ERROR_NO_HANDLE 0x3
+
+// Define SD_MAX_OPEN_FILES to add a pool of file handles to SdClass, see
+// sd_open_handle().
+
+// Define SD_PATH_CACHE as the number of resolved directory paths to remember.
+// See SdPathEntry.
+#ifdef SD_PATH_CACHE
+#define SD_PATH_HASH_INIT 2166136261UL
+#endif
+
 
 /*******************************************************************************
  * Types
@@ -60,6 +86,7 @@ typedef struct sd_class SdClass;
 struct sd_class
 {
     SdCard card;
+    SdBlockDev dev; // the card as seen by the FAT volume
     SdVolume volume;
     SdFile root;
 
@@ -68,18 +95,59 @@ struct sd_class
     // walking function. But it's probably not the best place for it. It
     // shouldn't be set directly--it is set via the parameters to `open`.
     int file_open_mode;
+
+    uint8_t error_code; // SD_ERROR_* of the last sd_open_file()
+#ifdef SD_MAX_OPEN_FILES
+    SdFile files[SD_MAX_OPEN_FILES]; // closed handles are free
+#endif
+};
+
+#ifdef SD_PATH_CACHE
+/**
+ * A directory that sd_get_parent_dir() or sd_walk_path() resolved from the
+ * root, keyed by a hash of its path, e.g. "LOGS/2026/". Later paths that
+ * start with it are resolved from its directory entry instead of scanning
+ * each parent directory again.
+ */
+typedef struct sd_path_entry SdPathEntry;
+struct sd_path_entry
+{
+    SdVolume* vol;          // NULL if this entry is unused
+    uint32_t hash;          // see sd_path_hash()
+    uint32_t dir_block;     // block of the directory's entry in its parent
+    uint8_t dir_index;      // index of the entry in dir_block
+    uint8_t name[11];       // the entry's 8.3 name, see SdDir::name
+    uint32_t first_cluster; // to check that the entry is still the same one
+    uint16_t used;          // sd_path_tick when last used, for LRU
 };
+#endif
 
 typedef bool (*SdWalkPathFunc)(SdFile* parent_dir,
                                const char* file_path_component,
                                bool is_last_component, void* object);
 
 
+/*******************************************************************************
+ * Global Data
+ ******************************************************************************/
+#ifdef SD_PATH_CACHE
+SdPathEntry sd_path_cache[SD_PATH_CACHE];
+uint16_t sd_path_tick;
+#endif
+
+
 /*******************************************************************************
  * Function Declarations
  ******************************************************************************/
 /*
- * Performs the initialisation required by the sdfatlib library.
+ * Performs the initialisation required by the sdfatlib library. The SPI clock
+ * is then raised to the fastest rate the card supports, see
+ * sd_card_calibrate_sck_rate(). Every handle in the SD_MAX_OPEN_FILES pool is
+ * made free.
+ *
+ * With SD_SNAPSHOT defined, the calibrated rate and the volume geometry are
+ * saved to EEPROM, and the next sd_begin() with the same card restores them
+ * instead. See sd_snapshot.h.
  *
  * Return true if initialization succeeds, false otherwise.
  */
@@ -87,18 +155,66 @@ SA_FUNC bool sd_begin(SdClass*, SdFileDateTime);
 
 /**
  * Call this when a card is removed. It will allow you to inster and initialise
- * a new card.
+ * a new card. Handles still open in the SD_MAX_OPEN_FILES pool are closed.
  */
 SA_FUNC void sd_end(SdClass*);
 
 /**
- * This little helper is used to traverse paths.
+ * Open the directory that contains the last component of a path. The walk
+ * alternates between two handles, so no handle is copied, and ends in @a dir.
+ * The root directory itself is never copied: @a parent then points at the
+ * SdClass's root handle, which must not be closed.
+ *
+ * @param[in] filepath A path from the root, e.g. "LOGS/2018/DATA.CSV".
+ * @param[in] dir A closed handle, for the parent directory.
+ * @param[in] tmp A closed handle, used during the walk and closed after.
+ * @param[out] parent Set to @a dir or to the root handle.
+ * @param[out] index Set to the offset in @a filepath of the last component.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure, with SdClass::error_code set.
+ */
+SA_FUNC bool sd_open_parent(SdClass*, const char*, SdFile*, SdFile*, SdFile**,
+                            int*);
+
+/**
+ * This little helper is used to traverse paths. It returns a copy of the
+ * parent directory, see sd_open_parent().
  *
  * @param [in]  sd
  * @param [in]  filepath
  * @param [out] index
  */
-SA_FUNC SdFile sd_get_parent_dir(SdClass*, const char*, int*)
+SA_FUNC SdFile sd_get_parent_dir(SdClass*, const char*, int*);
+
+/**
+ * Open a path into a handle owned by the caller. This is sd_open() without
+ * the copies of SdFile: the walk uses @a file and one handle on the stack.
+ *
+ * @param[out] file The handle to open. Any file it had open is forgotten, so
+ *   it should be closed.
+ * @param[in] filepath A path from the root. A path that ends in / opens the
+ *   directory.
+ * @param[in] mode The O_* flags of sd_file_open().
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure. SdClass::error_code is set to
+ *   SD_ERROR_NO_PATH or SD_ERROR_OPEN on failure, or SD_ERROR_NONE.
+ */
+SA_FUNC bool sd_open_file(SdClass*, SdFile*, const char*, uint8_t);
+
+#ifdef SD_MAX_OPEN_FILES
+/**
+ * Open a path into a free handle from the SdClass's pool. A handle is free
+ * while it's closed, so sd_file_close() returns it to the pool.
+ *
+ * @param[out] file Set to the handle, if one was free.
+ *
+ * @return As sd_open_file(). SdClass::error_code is SD_ERROR_NO_HANDLE if all
+ *   SD_MAX_OPEN_FILES handles are open.
+ */
+SA_FUNC bool sd_open_handle(SdClass*, SdFile**, const char*, uint8_t);
+#endif
 
 /*
  * Open the supplied file path for reading or writing.
@@ -201,6 +317,10 @@ SA_FUNC bool get_next_path_component(const char*, unsigned int*, char*);
  * If a directory path specified is complete, valid and the callback did not
  * indicate the traversal should be interrupted then this function will return
  * true.
+ *
+ * With SD_PATH_CACHE defined, a walk from the root starts at the deepest
+ * parent directory of the path that is in the path cache. The callback isn't
+ * called for the directories above it, which are known to exist.
  */
 SA_FUNC bool sd_walk_path(const char*, SdFile*, SdWalkPathFunc, void*);
 
@@ -224,126 +344,362 @@ SA_INLINE bool sd_remove(SdClass*, const char*);
 /*******************************************************************************
  * Function Definitions
  ******************************************************************************/
+#ifdef SD_PATH_CACHE
+/** Forget every resolved path. */
+SA_FUNC void sd_path_cache_clear()
+{
+    memset(sd_path_cache, 0, sizeof(sd_path_cache));
+    sd_path_tick = 0;
+}
+
+
+// Add @a n characters of a path to its hash. 8.3 names ignore case.
+SA_FUNC uint32_t sd_path_hash(uint32_t hash, const char* path, uint8_t n)
+{
+    while (n--) {
+        hash = (hash ^ (uint8_t) toupper(*path++)) * 16777619UL;
+    }
+    return hash;
+}
+
+
+SA_FUNC SdPathEntry* sd_path_cache_find(SdVolume* vol, uint32_t hash)
+{
+    for (uint8_t i = 0; i < SD_PATH_CACHE; i++) {
+        if (sd_path_cache[i].vol == vol && sd_path_cache[i].hash == hash) {
+            return &sd_path_cache[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Remember the open directory @a dir as the path with @a hash
+SA_FUNC void sd_path_cache_put(uint32_t hash, SdFile* dir)
+{
+    SdCache* cache = sd_volume_cache_raw_block(dir->dir_block, CACHE_FOR_READ);
+    if (!cache) {
+        return;
+    }
+    SdPathEntry* entry = sd_path_cache_find(dir->vol, hash);
+    if (!entry) {
+        // replace the least recently used entry
+        entry = &sd_path_cache[0];
+        for (uint8_t i = 1; i < SD_PATH_CACHE; i++) {
+            if ((uint16_t) (sd_path_tick - sd_path_cache[i].used)
+                    > (uint16_t) (sd_path_tick - entry->used)) {
+                entry = &sd_path_cache[i];
+            }
+        }
+    }
+    entry->vol = dir->vol;
+    entry->hash = hash;
+    entry->dir_block = dir->dir_block;
+    entry->dir_index = dir->dir_index;
+    memcpy(entry->name, cache->dir[dir->dir_index].name, sizeof(entry->name));
+    entry->first_cluster = dir->first_cluster;
+    entry->used = ++sd_path_tick;
+}
+
+
+// Open the directory of a cached path. A stale entry is dropped, e.g. if the
+// directory was removed and its slot and cluster reused by another one.
+SA_FUNC bool sd_path_cache_open(SdPathEntry* entry, SdFile* dir)
+{
+    SdCache* cache = sd_volume_cache_raw_block(entry->dir_block, CACHE_FOR_READ);
+    if (cache && !memcmp(cache->dir[entry->dir_index].name, entry->name,
+                         sizeof(entry->name))) {
+        sd_file_init(dir);
+        dir->vol = entry->vol;
+        if (sd_file_open_cached_entry(dir, entry->dir_index, O_READ)
+                && sd_file_is_subdir(dir)
+                && dir->first_cluster == entry->first_cluster) {
+            entry->used = ++sd_path_tick;
+            return true;
+        }
+        dir->type = FAT_FILE_TYPE_CLOSED;
+    }
+    entry->vol = NULL;
+    return false;
+}
+
+
+/**
+ * Find the deepest parent directory of @a path, relative to the root of
+ * @a vol, that is in the path cache. Open it with sd_path_cache_open().
+ *
+ * @param[out] offset Set to the offset in @a path just after that directory.
+ * @param[out] hash Set to the hash of the path of that directory.
+ *
+ * @return The entry, or NULL if no parent directory is cached.
+ */
+SA_FUNC SdPathEntry* sd_path_cache_longest(SdVolume* vol, const char* path,
+                                           unsigned int* offset,
+                                           uint32_t* hash)
+{
+    SdPathEntry* best = NULL;
+    uint32_t h = SD_PATH_HASH_INIT;
+
+    unsigned int i = 0;
+    while (path[i] == '/') {
+        i++;
+    }
+    for (;;) {
+        const char* end = strchr(path + i, '/');
+        if (!end || end[1] == '\0') {
+            break; // the last component isn't a parent directory
+        }
+        h = sd_path_hash(h, path + i, end - (path + i) + 1);
+
+        // a hash collision must still name the same directory
+        char component[13];
+        uint8_t name[11];
+        const uint8_t len = end - (path + i) > 12 ? 12 : end - (path + i);
+        memcpy(component, path + i, len);
+        component[len] = '\0';
+        i = end - path;
+        SdPathEntry* entry = sd_path_cache_find(vol, h);
+        if (entry && sd_file_make83_name(component, name)
+                && !memcmp(name, entry->name, sizeof(name))) {
+            best = entry;
+            *offset = i;
+            *hash = h;
+        }
+        while (path[i] == '/') {
+            i++;
+        }
+    }
+    return best;
+}
+#endif
+
+
 SA_FUNC bool sd_begin(SdClass* sd, SdFileDateTime date_time_callback)
 {
     sd_date_time_callback = date_time_callback;
-    cache_block_number = 0xFFFFFFFF;
-    cache_dirty = 0;
-    cache_mirror_block = 0;
+    sd_volume_cache_init();
+#ifdef SD_MAX_OPEN_FILES
+    for (uint8_t i = 0; i < SD_MAX_OPEN_FILES; i++) {
+        sd_file_init(&sd->files[i]);
+    }
+#endif
+#ifdef SD_PATH_CACHE
+    sd_path_cache_clear();
+#endif
+
+    if (!sd_card_init(&(sd->card), SPI_QUARTER_SPEED)) {
+        return false;
+    }
+    sd_card_block_dev(&(sd->dev), &(sd->card));
 
-    return sd_card_init(&(sd->card), SPI_HALF_SPEED)
-        && sd_volume_init_try_both(&(sd->volume), &(sd->card))
-        && sd_file_open_root(&(sd->root), &(sd->volume));
+#ifdef SD_SNAPSHOT
+    // warm mount, if this card was the last one mounted
+    if (sd_snapshot_mount(&(sd->card), &(sd->dev), &(sd->volume))) {
+        return sd_file_open_root(&(sd->root), &(sd->volume));
+    }
+#endif
+    if (!sd_card_calibrate_sck_rate(&(sd->card))
+            || !sd_volume_init_try_both(&(sd->volume), &(sd->dev))) {
+        return false;
+    }
+#ifdef SD_SNAPSHOT
+    sd_snapshot_save(&(sd->card), &(sd->volume));
+#endif
+    return sd_file_open_root(&(sd->root), &(sd->volume));
 }
 
 
 SA_FUNC void sd_end(SdClass* sd)
 {
+#ifdef SD_MAX_OPEN_FILES
+    for (uint8_t i = 0; i < SD_MAX_OPEN_FILES; i++) {
+        if (sd_file_is_open(&sd->files[i])) {
+            sd_file_close(&sd->files[i]);
+        }
+    }
+#endif
+#ifdef SD_SNAPSHOT
+    // keep the allocation hint for the next mount
+    sd_snapshot_save(&sd->card, &sd->volume);
+#endif
+#ifdef SD_PATH_CACHE
+    sd_path_cache_clear();
+#endif
     sd_file_close(&sd->root);
 }
 
 
-SA_FUNC SdFile sd_get_parent_dir(SdClass* sd, const char* filepath, int* index)
+// The number of directories sd_open_parent() opens for @a path
+SA_FUNC uint8_t sd_count_parents(const char* path)
 {
-    // get parent directory
-    SdFile d1 = sd->root; // start with the mostparent, root!
-    SdFile d2;
-    sd_file_init(&d2);
+    uint8_t count = 0;
+    for (; *path; path++) {
+        if (path[0] != '/' && path[1] == '/') {
+            count++;
+        }
+    }
+    return count;
+}
 
-    // we'll use the pointers to swap between the two objects
-    SdFile* parent = &d1;
-    SdFile* subdir = &d2;
 
+SA_FUNC bool sd_open_parent(SdClass* sd, const char* filepath, SdFile* dir,
+                            SdFile* tmp, SdFile** parent, int* index)
+{
     const char* origpath = filepath;
+    SdFile* cur = &sd->root; // start with the mostparent, root!
+
+#ifdef SD_PATH_CACHE
+    // start from the deepest directory already resolved
+    uint32_t hash = SD_PATH_HASH_INIT;
+    unsigned int offset;
+    SdPathEntry* entry = sd_path_cache_longest(&sd->volume, filepath,
+                                               &offset, &hash);
+    if (entry) {
+        SdFile* start = sd_count_parents(filepath + offset) & 1 ? tmp : dir;
+        if (sd_path_cache_open(entry, start)) {
+            cur = start;
+            filepath += offset;
+        } else {
+            hash = SD_PATH_HASH_INIT;
+        }
+    }
+#endif
 
-    while (strchr(filepath, '/')) {
+    // alternate between the two handles, so that the last one lands in dir
+    SdFile* next;
+    if (cur == &sd->root) {
+        next = sd_count_parents(filepath) & 1 ? dir : tmp;
+    } else {
+        next = cur == dir ? tmp : dir;
+    }
+
+    for (;;) {
         // strip leading /'s
-        if (filepath[0] == '/') {
+        while (filepath[0] == '/') {
             filepath++;
-            continue;
         }
-
-        if (!strchr(filepath, '/')) {
-            break; // it was in the root directory, so leave now
+        const char* end = strchr(filepath, '/');
+        if (!end) {
+            break; // filepath is the name of the file in cur
         }
 
         // extract just the name of the next subdirectory
-        uint8_t idx = strchr(filepath, '/') - filepath;
+        uint8_t idx = end - filepath;
         if (idx > 12) {
             idx = 12;    // dont let them specify long names
         }
         char subdirname[13];
-        strncpy(subdirname, filepath, idx);
+        memcpy(subdirname, filepath, idx);
         subdirname[idx] = 0;
 
-        // close the subdir (we reuse them) if open
-        sd_file_close(subdir);
-
-        if (!sd_file_open(subdir, parent, subdirname, O_READ)) {
-            return (SdFile) { 0 }; // failed to open one of the subdirectories
+        sd_file_init(next);
+        if (!sd_file_open(next, cur, subdirname, O_READ)) {
+            if (cur != &sd->root) {
+                sd_file_close(cur);
+            }
+            sd->error_code = SD_ERROR_NO_PATH;
+            return false;
         }
-        // move forward to the next subdirectory
-        filepath += idx;
-
-        // we reuse the objects, close it.
-        sd_file_close(parent);
-
-        // swap the pointers
-        SdFile* t = parent;
-        parent = subdir;
-        subdir = t;
+#ifdef SD_PATH_CACHE
+        hash = sd_path_hash(hash, filepath, end - filepath + 1);
+        sd_path_cache_put(hash, next);
+#endif
+        filepath = end;
+
+        // we reuse the handles, so close the old parent
+        if (cur != &sd->root) {
+            sd_file_close(cur);
+        }
+        cur = next;
+        next = cur == dir ? tmp : dir;
     }
 
+    *parent = cur;
     *index = (int) (filepath - origpath);
-    // parent is now the parent diretory of the file!
+    return true;
+}
+
+
+SA_FUNC SdFile sd_get_parent_dir(SdClass* sd, const char* filepath, int* index)
+{
+    SdFile dir;
+    SdFile tmp;
+    SdFile* parent;
+    if (!sd_open_parent(sd, filepath, &dir, &tmp, &parent, index)) {
+        RETURN_ERR_FILE;
+    }
     return *parent;
 }
 
 
-SA_FUNC SdFile sd_open(SdClass* sd, const char* filepath, uint8_t mode)
+SA_FUNC bool sd_open_file(SdClass* sd, SdFile* file, const char* filepath,
+                          uint8_t mode)
 {
+    SdFile dir;
+    SdFile* parent;
     int pathidx;
 
-    // do the interative search
-    SdFile parentdir = sd_get_parent_dir(sd, filepath, &pathidx);
-    // no more subdirs!
+    // a path that ends in / names the last directory, which then lands in
+    // file itself
+    const size_t len = strlen(filepath);
+    const bool is_dir = len == 0 || filepath[len - 1] == '/';
 
-    filepath += pathidx;
+    sd_file_init(file);
+    if (!sd_open_parent(sd, filepath, is_dir ? file : &dir,
+                        is_dir ? &dir : file, &parent, &pathidx)) {
+        return false;
+    }
 
+    filepath += pathidx;
     if (!filepath[0]) {
-        return parentdir; // it was the directory itself!
+        if (parent == &sd->root) {
+            *file = sd->root;
+        }
+        sd->error_code = SD_ERROR_NONE;
+        return true; // it was the directory itself!
     }
 
-    // Open the file itself
-    SdFile file;
-    sd_file_init(&file);
-
-    // failed to open a subdir!
-    if (!sd_file_is_open(&parentdir)) {
-        RETURN_ERR_FILE;
+    const bool opened = sd_file_open(file, parent, filepath, mode);
+    if (parent != &sd->root) {
+        sd_file_close(parent); // dont close the root!
     }
-
-    // there is a special case for the Root directory since its a static dir
-    if (sd_file_is_root(&parentdir)) {
-        if (!sd_file_open(&file, &sd->root, filepath, mode)) {
-            // failed to open the file :(
-            RETURN_ERR_FILE;
-        }
-        // dont close the root!
-    } else {
-        if (!sd_file_open(&file, &parentdir, filepath, mode)) {
-            RETURN_ERR_FILE;
-        }
-        // close the parent
-        sd_file_close(&parentdir);
+    if (!opened) {
+        sd->error_code = SD_ERROR_OPEN;
+        return false;
     }
 
     if (mode & (O_APPEND | O_WRITE)) {
-        sd_file_seek_set(&file, file.file_size);
+        sd_file_seek_set(file, file->file_size);
     }
+    sd->error_code = SD_ERROR_NONE;
+    return true;
+}
+
+
+SA_FUNC SdFile sd_open(SdClass* sd, const char* filepath, uint8_t mode)
+{
+    SdFile file;
+    sd_open_file(sd, &file, filepath, mode);
     return file;
 }
 
+
+#ifdef SD_MAX_OPEN_FILES
+SA_FUNC bool sd_open_handle(SdClass* sd, SdFile** file, const char* filepath,
+                            uint8_t mode)
+{
+    for (uint8_t i = 0; i < SD_MAX_OPEN_FILES; i++) {
+        if (!sd_file_is_open(&sd->files[i])) {
+            *file = &sd->files[i];
+            return sd_open_file(sd, *file, filepath, mode);
+        }
+    }
+    sd->error_code = SD_ERROR_NO_HANDLE;
+    return false;
+}
+#endif
+
+
 SA_FUNC bool sd_callback_path_exists(SdFile* parent_dir,
                                     const char* file_path_component,
                                     __attribute__((unused)) bool is_last_component,
@@ -463,6 +819,21 @@ SA_FUNC bool sd_walk_path(const char* filepath, SdFile* parent_dir,
     p_child = &subfile1;
     p_parent = parent_dir;
 
+#ifdef SD_PATH_CACHE
+    // start from the deepest directory already resolved
+    const bool cache_path = sd_file_is_root(parent_dir);
+    uint32_t hash = SD_PATH_HASH_INIT;
+    SdPathEntry* entry = cache_path
+        ? sd_path_cache_longest(parent_dir->vol, filepath, &offset, &hash)
+        : NULL;
+    if (entry && sd_path_cache_open(entry, &subfile2)) {
+        p_parent = &subfile2;
+    } else {
+        offset = 0;
+        hash = SD_PATH_HASH_INIT;
+    }
+#endif
+
     while (true) {
         bool more_components = get_next_path_component(filepath, &offset, buffer);
         bool should_continue = callback(p_parent, buffer, !more_components, object);
@@ -488,6 +859,13 @@ SA_FUNC bool sd_walk_path(const char* filepath, SdFile* parent_dir,
         }
 
         // Handle case when it doesn't exist and we can't continue...
+#ifdef SD_PATH_CACHE
+        if (exists && cache_path) {
+            hash = sd_path_hash(hash, buffer, strlen(buffer));
+            hash = sd_path_hash(hash, "/", 1);
+            sd_path_cache_put(hash, p_child);
+        }
+#endif
         if (exists) {
             // We alternate between two file handles as we go down the path.
             if (p_parent == parent_dir) {
@@ -530,6 +908,10 @@ SA_INLINE bool sd_mkdir(SdClass* sd, const char* filepath)
 
 SA_INLINE bool sd_rmdir(SdClass* sd, const char* filepath)
 {
+#ifdef SD_PATH_CACHE
+    // the directory and any below it may be cached
+    sd_path_cache_clear();
+#endif
     return sd_walk_path(filepath, &sd->root, sd_callback_rmdir, NULL);
 }
 
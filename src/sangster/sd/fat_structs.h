@@ -319,6 +319,50 @@ struct fat32_boot_sector {
 } __attribute__((packed));
 
 
+/** Lead signature of a FAT32 FSINFO sector */
+#define FSINFO_LEAD_SIG ((uint32_t) 0x41615252)
+
+/** Signature before the fields of a FAT32 FSINFO sector */
+#define FSINFO_STRUCT_SIG ((uint32_t) 0x61417272)
+
+/** Value of an FSINFO free_count or next_free that is not known */
+#define FSINFO_UNKNOWN ((uint32_t) 0xFFFFFFFF)
+
+
+/**
+ * @struct fat32_fsinfo
+ *
+ * @brief FSINFO sector of a FAT32 volume, located by SdBpb::fat32_fs_info.
+ *
+ * Both counts are only hints, and may be FSINFO_UNKNOWN.
+ */
+typedef struct fat32_fsinfo SdFsInfo;
+struct fat32_fsinfo {
+    /** must be FSINFO_LEAD_SIG */
+    uint32_t lead_signature;
+
+    /** should be zero */
+    uint8_t reserved1[480];
+
+    /** must be FSINFO_STRUCT_SIG */
+    uint32_t struct_signature;
+
+    /** last known count of free clusters on the volume */
+    uint32_t free_count;
+
+    /** cluster number at which to start looking for free clusters */
+    uint32_t next_free;
+
+    /** should be zero */
+    uint8_t reserved2[12];
+
+    /** must be 0x00, 0x00, 0x55, 0xAA */
+    uint8_t reserved3[2];
+    uint8_t tail_sig0;
+    uint8_t tail_sig1;
+} __attribute__((packed));
+
+
 // End Of Chain values for FAT entries
 /** FAT16 end of chain value used by Microsoft. */
 #define FAT16EOC ((uint16_t) 0xFFFF)
@@ -0,0 +1,416 @@
+#ifndef SD_ASYNC_H
+#define SD_ASYNC_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * Moves the 512 data bytes of an SD card block between the card and a
+ * caller's buffer in the background, one byte per `SPI_STC` interrupt, so the
+ * CPU is free to do other work while a block is in flight.
+ *
+ * The command phase of each transfer (sending the command and waiting for
+ * the start block token, or for the card to go not busy) is still done
+ * before the sd_async_*() function returns. Only the data phase runs in the
+ * background.
+ *
+ * The SPI interrupt must be forwarded to this module:
+ *
+ *     ISR(SPI_STC_vect)
+ *     {
+ *         sd_async_interrupt_callback();
+ *     }
+ *
+ * @note At the fastest SCK rates the interrupt overhead is longer than the
+ *   time taken to shift out a byte, so the bus runs slower than the polled
+ *   sd_card_*() loops. Use this where freeing the CPU matters more than raw
+ *   throughput.
+ */
+#include <stdbool.h>
+#include <avr/io.h>
+#include "sangster/api.h"
+#include "sangster/pinout.h"
+#include "sangster/sd/sd_card.h"
+
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/** No transfer is in flight. */
+#define SD_ASYNC_PHASE_IDLE 0
+
+/** Sending the data token of a write */
+#define SD_ASYNC_PHASE_TOKEN 1
+
+/** Moving the 512 data bytes */
+#define SD_ASYNC_PHASE_DATA 2
+
+/** Moving the first CRC byte */
+#define SD_ASYNC_PHASE_CRC_HIGH 3
+
+/** Moving the second CRC byte */
+#define SD_ASYNC_PHASE_CRC_LOW 4
+
+/** Receiving the data response token of a write */
+#define SD_ASYNC_PHASE_RESPONSE 5
+
+
+/** The transfer is a read */
+#define SD_ASYNC_OP_READ 0x01
+
+/** The transfer is part of a multiple block sequence */
+#define SD_ASYNC_OP_SEQ 0x02
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+/**
+ * Called, from the SPI interrupt, when a background transfer finishes.
+ *
+ * @param ok The value one, true, if the transfer succeeded.
+ */
+typedef void (*SdAsyncCallback)(uint8_t ok);
+
+typedef struct sd_async SdAsync;
+struct sd_async
+{
+    SdCard* card;
+    uint8_t* buf;             // caller's buffer
+    uint16_t offset;          // bytes moved so far
+    uint16_t crc;             // CRC16 of a write, when card->write_crc is set
+    uint8_t op;               // See SD_ASYNC_OP_*
+    volatile uint8_t phase;   // See SD_ASYNC_PHASE_*
+    volatile uint8_t ok;      // result of the last transfer
+    uint8_t pending_status;   // single block write needs a status check
+    SdAsyncCallback callback; // optional completion callback
+};
+
+
+/*******************************************************************************
+ * Global Data
+ ******************************************************************************/
+SdAsync sd_async;
+
+
+/*******************************************************************************
+ * Function Declarations
+ ******************************************************************************/
+/** Forward the `SPI_STC` interrupt to this function. */
+SA_INLINE void sd_async_interrupt_callback();
+
+/** @return True while a background transfer is in flight. */
+SA_INLINE uint8_t sd_async_is_busy();
+
+/**
+ * Wait for the background transfer to finish.
+ *
+ * For a single block write, this also waits for the card to finish
+ * programming flash and checks the card status, like sd_card_write_block(),
+ * unless deferred busy waiting is enabled (see sd_card_defer_busy()).
+ *
+ * @return The value one, true, is returned if the transfer succeeded and the
+ *   value zero, false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_async_wait();
+
+/**
+ * Start reading a 512 byte block in the background.
+ *
+ * @param[in] block_number Logical block to be read.
+ * @param[out] dst The buffer to receive the data. It must remain valid until
+ *   the transfer finishes.
+ * @param[in] callback Called when the transfer finishes. May be `NULL`.
+ *
+ * @return The value one, true, is returned if the transfer was started and
+ *   the value zero, false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_async_read_block(SdCard*, uint32_t block_number,
+                                    uint8_t* dst, SdAsyncCallback callback);
+
+/**
+ * Start reading the next block of a read multiple blocks sequence (see
+ * sd_card_read_start()) in the background.
+ */
+SA_FUNC uint8_t sd_async_read_data_seq(SdCard*, uint8_t* dst,
+                                       SdAsyncCallback callback);
+
+/**
+ * Start writing a 512 byte block in the background.
+ *
+ * @param[in] block_number Logical block to be written.
+ * @param[in] src The data to be written. It must remain valid until the
+ *   transfer finishes.
+ * @param[in] callback Called when the transfer finishes. May be `NULL`.
+ *
+ * @return The value one, true, is returned if the transfer was started and
+ *   the value zero, false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_async_write_block(SdCard*, uint32_t block_number,
+                                     const uint8_t* src,
+                                     SdAsyncCallback callback);
+
+/**
+ * Start writing the next block of a write multiple blocks sequence (see
+ * sd_card_write_start()) in the background.
+ */
+SA_FUNC uint8_t sd_async_write_data_seq(SdCard*, const uint8_t* src,
+                                        SdAsyncCallback callback);
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+SA_INLINE void sd_async_finish(uint8_t ok)
+{
+    SPCR &= ~_BV(SPIE);
+    if (!(sd_async.op & SD_ASYNC_OP_SEQ)) {
+        if ((sd_async.op & SD_ASYNC_OP_READ) || !ok) {
+            pinout_set(sd_async.card->chip_select_pin);
+        } else if (sd_async.card->defer_busy) {
+            // the next command waits for programming to finish
+            sd_async.card->busy = 1;
+            pinout_set(sd_async.card->chip_select_pin);
+        }
+    } else if (ok) {
+        sd_async.card->seq_block++;
+    } else {
+        sd_async.card->in_read_seq = 0;
+        sd_async.card->in_write_seq = 0;
+        pinout_set(sd_async.card->chip_select_pin);
+    }
+    if (!ok) {
+        if (!(sd_async.op & SD_ASYNC_OP_READ)) {
+            sd_async.card->error_code = SD_CARD_ERROR_WRITE;
+        } else if (sd_async.phase == SD_ASYNC_PHASE_CRC_LOW) {
+            sd_async.card->error_code = SD_CARD_ERROR_READ_CRC;
+        } else {
+            sd_async.card->error_code = SD_CARD_ERROR_READ;
+        }
+    }
+    if (ok && (sd_async.op & SD_ASYNC_OP_READ)) {
+        SD_CARD_STAT_BYTES(sd_async.card, bytes_read, 512);
+    } else if (ok) {
+        SD_CARD_STAT_BYTES(sd_async.card, bytes_written, 512);
+    }
+    sd_async.ok = ok;
+    sd_async.phase = SD_ASYNC_PHASE_IDLE;
+    sd_async.card->in_async = 0;
+
+    if (sd_async.callback) {
+        sd_async.callback(ok);
+    }
+}
+
+
+SA_INLINE void sd_async_interrupt_callback()
+{
+    const uint8_t in = SPDR;
+
+    switch (sd_async.phase) {
+        case SD_ASYNC_PHASE_TOKEN:
+            sd_async.phase = SD_ASYNC_PHASE_DATA;
+            SPDR = sd_async.buf[sd_async.offset++];
+            break;
+
+        case SD_ASYNC_PHASE_DATA:
+            if (sd_async.op & SD_ASYNC_OP_READ) {
+                sd_async.buf[sd_async.offset - 1] = in;
+                if (sd_async.card->check_crc) {
+                    sd_async.crc = sd_crc16_update(sd_async.crc, in);
+                }
+            } else if (sd_async.card->write_crc) {
+                sd_async.crc = sd_crc16_update(sd_async.crc,
+                                               sd_async.buf[sd_async.offset - 1]);
+            }
+            if (sd_async.offset < 512) {
+                SPDR = sd_async.op & SD_ASYNC_OP_READ
+                    ? 0xFF : sd_async.buf[sd_async.offset];
+                sd_async.offset++;
+            } else {
+                sd_async.phase = SD_ASYNC_PHASE_CRC_HIGH;
+                SPDR = sd_async.op & SD_ASYNC_OP_READ ? 0xFF : sd_async.crc >> 8;
+            }
+            break;
+
+        case SD_ASYNC_PHASE_CRC_HIGH:
+            sd_async.phase = SD_ASYNC_PHASE_CRC_LOW;
+            if (sd_async.op & SD_ASYNC_OP_READ) {
+                sd_async.crc ^= in << 8; // zero if it matches
+                SPDR = 0xFF;
+            } else {
+                SPDR = sd_async.crc;
+            }
+            break;
+
+        case SD_ASYNC_PHASE_CRC_LOW:
+            if (sd_async.op & SD_ASYNC_OP_READ) {
+                sd_async.crc ^= in;
+                sd_async_finish(!sd_async.card->check_crc || !sd_async.crc);
+            } else {
+                sd_async.phase = SD_ASYNC_PHASE_RESPONSE;
+                SPDR = 0xFF;
+            }
+            break;
+
+        case SD_ASYNC_PHASE_RESPONSE:
+            sd_async.card->status = in;
+            sd_async_finish((in & DATA_RES_MASK) == DATA_RES_ACCEPTED);
+            break;
+    }
+}
+
+
+SA_INLINE uint8_t sd_async_is_busy()
+{
+    return sd_async.phase != SD_ASYNC_PHASE_IDLE;
+}
+
+
+// Hand the bus to the SPI interrupt, starting with the given first byte
+SA_FUNC void sd_async_start(SdCard* card, uint8_t* buf, uint8_t op,
+                            uint8_t phase, uint8_t first,
+                            SdAsyncCallback callback)
+{
+    card->in_async = 1;
+    sd_async.card = card;
+    sd_async.buf = buf;
+    sd_async.offset = phase == SD_ASYNC_PHASE_DATA ? 1 : 0;
+    // a write's CRC may be a dummy value
+    sd_async.crc = (op & SD_ASYNC_OP_READ) || card->write_crc ? 0 : 0xFFFF;
+    sd_async.op = op;
+    sd_async.ok = false;
+    sd_async.pending_status = !(op & (SD_ASYNC_OP_READ | SD_ASYNC_OP_SEQ))
+        && !card->defer_busy;
+    sd_async.callback = callback;
+    sd_async.phase = phase;
+
+    SPDR = first;
+    SPCR |= _BV(SPIE);
+}
+
+
+SA_FUNC uint8_t sd_async_wait()
+{
+    while (sd_async_is_busy())
+        ;
+
+    if (sd_async.pending_status) {
+        SdCard* card = sd_async.card;
+        sd_async.pending_status = false;
+
+        if (sd_async.ok) {
+            // wait for flash programming to complete
+            pinout_clr(card->chip_select_pin);
+            if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
+                card->error_code = SD_CARD_ERROR_WRITE_TIMEOUT;
+                sd_async.ok = false;
+            // response is r2 so get and check two bytes for nonzero
+            } else if (sd_card_card_command(card, CMD13, 0) || spi_rec()) {
+                card->error_code = SD_CARD_ERROR_WRITE_PROGRAMMING;
+                sd_async.ok = false;
+            }
+            pinout_set(card->chip_select_pin);
+        }
+    }
+    return sd_async.ok;
+}
+
+
+SA_FUNC uint8_t sd_async_read_block(SdCard* card, uint32_t block_number,
+                                    uint8_t* dst, SdAsyncCallback callback)
+{
+    sd_async_wait();
+
+    // use address if not SDHC card
+    if (card->type != SD_CARD_TYPE_SDHC) {
+        block_number <<= 9;
+    }
+    if (sd_card_card_command(card, CMD17, block_number)) {
+        card->error_code = SD_CARD_ERROR_CMD17;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    if (!sd_card_wait_start_block(card)) {
+        return false;
+    }
+    sd_async_start(card, dst, SD_ASYNC_OP_READ, SD_ASYNC_PHASE_DATA, 0xFF,
+                   callback);
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_async_read_data_seq(SdCard* card, uint8_t* dst,
+                                       SdAsyncCallback callback)
+{
+    sd_async_wait();
+
+    if (!card->in_read_seq) {
+        return false;
+    }
+    if (!sd_card_wait_start_block(card)) {
+        card->in_read_seq = 0;
+        return false;
+    }
+    sd_async_start(card, dst, SD_ASYNC_OP_READ | SD_ASYNC_OP_SEQ,
+                   SD_ASYNC_PHASE_DATA, 0xFF, callback);
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_async_write_block(SdCard* card, uint32_t block_number,
+                                     const uint8_t* src,
+                                     SdAsyncCallback callback)
+{
+    sd_async_wait();
+
+    // use address if not SDHC card
+    if (card->type != SD_CARD_TYPE_SDHC) {
+        block_number <<= 9;
+    }
+    if (sd_card_card_command(card, CMD24, block_number)) {
+        card->error_code = SD_CARD_ERROR_CMD24;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    sd_async_start(card, (uint8_t*) src, 0, SD_ASYNC_PHASE_TOKEN,
+                   DATA_START_BLOCK, callback);
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_async_write_data_seq(SdCard* card, const uint8_t* src,
+                                        SdAsyncCallback callback)
+{
+    sd_async_wait();
+
+    if (!card->in_write_seq) {
+        return false;
+    }
+    // wait for previous write to finish
+    if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
+        card->error_code = SD_CARD_ERROR_WRITE_MULTIPLE;
+        card->in_write_seq = 0;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    sd_async_start(card, (uint8_t*) src, SD_ASYNC_OP_SEQ, SD_ASYNC_PHASE_TOKEN,
+                   WRITE_MULTIPLE_TOKEN, callback);
+    return true;
+}
+#endif//SD_ASYNC_H
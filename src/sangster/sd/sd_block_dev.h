@@ -0,0 +1,297 @@
+#ifndef SD_BLOCK_DEV_H
+#define SD_BLOCK_DEV_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * A block device of 512 byte blocks, as seen by the FAT layer (sd_volume.h
+ * and sd_file.h). Each backend fills in a SdBlockDev with its operations:
+ *
+ *  - sd_card.h: sd_card_block_dev(), an SD card on the SPI bus.
+ *  - sd_ram_disk.h: sd_ram_disk_init(), blocks in a RAM buffer.
+ *  - sd_image_disk.h: sd_image_disk_open(), a disk image file, for host
+ *    builds.
+ *
+ * The FAT layer only calls the sd_block_dev_*() functions below, which keep
+ * track of open multiple block sequences and fall back to single block
+ * operations for backends that have none.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "sangster/api.h"
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+typedef struct sd_block_dev SdBlockDev;
+struct sd_block_dev
+{
+    void* ctx; // backend state, passed to each operation
+
+    // required operations
+    uint8_t (*read)(void* ctx, uint32_t block, uint16_t offset,
+                    uint16_t count, uint8_t* dst);
+    uint8_t (*write)(void* ctx, uint32_t block, const uint8_t* src);
+
+    // optional operations, may be NULL
+    uint8_t (*read_start)(void* ctx, uint32_t block);
+    uint8_t (*read_data)(void* ctx, uint8_t* dst);
+    uint8_t (*read_stop)(void* ctx);
+    uint8_t (*write_start)(void* ctx, uint32_t block, uint32_t erase_count);
+    uint8_t (*write_data)(void* ctx, const uint8_t* src);
+    uint8_t (*write_stop)(void* ctx);
+    uint8_t (*erase)(void* ctx, uint32_t first_block, uint32_t last_block);
+    uint8_t (*sync)(void* ctx);
+
+    uint8_t in_read_seq;  // a multiple block read is open
+    uint8_t in_write_seq; // a multiple block write is open
+    uint32_t seq_block;   // next block of the open sequence
+};
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+/**
+ * Clear a block device. The backend's init function then fills in its
+ * operations.
+ */
+SA_FUNC void sd_block_dev_init(SdBlockDev* dev)
+{
+    memset(dev, 0, sizeof(SdBlockDev));
+}
+
+
+/** End an open multiple block read. */
+SA_FUNC uint8_t sd_block_dev_read_stop(SdBlockDev* dev)
+{
+    if (!dev->in_read_seq) {
+        return true;
+    }
+    dev->in_read_seq = 0;
+    return dev->read_stop(dev->ctx);
+}
+
+
+/** End an open multiple block write. */
+SA_FUNC uint8_t sd_block_dev_write_stop(SdBlockDev* dev)
+{
+    if (!dev->in_write_seq) {
+        return true;
+    }
+    dev->in_write_seq = 0;
+    return dev->write_stop(dev->ctx);
+}
+
+
+/** End any open multiple block sequence. */
+SA_INLINE uint8_t sd_block_dev_end_seq(SdBlockDev* dev)
+{
+    return sd_block_dev_read_stop(dev) && sd_block_dev_write_stop(dev);
+}
+
+
+/**
+ * Read part of a block.
+ *
+ * @param[in] block Logical block to be read.
+ * @param[in] offset Number of bytes to skip at start of block
+ * @param[in] count Number of bytes to read
+ * @param[out] dst Pointer to the location that will receive the data.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_read(SdBlockDev* dev, uint32_t block,
+                                  uint16_t offset, uint16_t count,
+                                  uint8_t* dst)
+{
+    return sd_block_dev_end_seq(dev)
+        && dev->read(dev->ctx, block, offset, count, dst);
+}
+
+
+/** Read a 512 byte block. See sd_block_dev_read(). */
+SA_INLINE uint8_t sd_block_dev_read_block(SdBlockDev* dev, uint32_t block,
+                                          uint8_t* dst)
+{
+    return sd_block_dev_read(dev, block, 0, 512, dst);
+}
+
+
+/**
+ * Write a 512 byte block.
+ *
+ * @param[in] block Logical block to be written.
+ * @param[in] src Pointer to the location of the data to be written.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_write_block(SdBlockDev* dev, uint32_t block,
+                                         const uint8_t* src)
+{
+    return sd_block_dev_end_seq(dev) && dev->write(dev->ctx, block, src);
+}
+
+
+/**
+ * Read a 512 byte block as part of a multiple block read. The open sequence
+ * is continued if @a block is its next block, otherwise a new one is started.
+ *
+ * @param[in] block Logical block to be read.
+ * @param[out] dst Pointer to the location that will receive the data.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_read_block_seq(SdBlockDev* dev, uint32_t block,
+                                            uint8_t* dst)
+{
+    if (!dev->read_start) {
+        return sd_block_dev_read_block(dev, block, dst);
+    }
+    if (!dev->in_read_seq || dev->seq_block != block) {
+        if (!sd_block_dev_end_seq(dev) || !dev->read_start(dev->ctx, block)) {
+            return false;
+        }
+        dev->in_read_seq = 1;
+        dev->seq_block = block;
+    }
+    if (!dev->read_data(dev->ctx, dst)) {
+        dev->in_read_seq = 0;
+        return false;
+    }
+    dev->seq_block++;
+    return true;
+}
+
+
+/**
+ * Start a multiple block write.
+ *
+ * @param[in] block Address of first block in sequence.
+ * @param[in] erase_count The number of blocks to be pre-erased.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_write_start(SdBlockDev* dev, uint32_t block,
+                                         uint32_t erase_count)
+{
+    if (!sd_block_dev_end_seq(dev)) {
+        return false;
+    }
+    dev->seq_block = block;
+    if (dev->write_start) {
+        if (!dev->write_start(dev->ctx, block, erase_count)) {
+            return false;
+        }
+        dev->in_write_seq = 1;
+    }
+    return true;
+}
+
+
+/**
+ * Write the next block of a multiple block write started with
+ * sd_block_dev_write_start().
+ *
+ * @param[in] src Pointer to the location of the data to be written.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_write_data_seq(SdBlockDev* dev, const uint8_t* src)
+{
+    if (!dev->write_start) {
+        if (!dev->write(dev->ctx, dev->seq_block, src)) {
+            return false;
+        }
+    } else if (!dev->in_write_seq || !dev->write_data(dev->ctx, src)) {
+        dev->in_write_seq = 0;
+        return false;
+    }
+    dev->seq_block++;
+    return true;
+}
+
+
+/**
+ * Write a 512 byte block as part of a multiple block write. The open sequence
+ * is continued if @a block is its next block, otherwise a new one is started.
+ *
+ * @param[in] block Logical block to be written.
+ * @param[in] src Pointer to the location of the data to be written.
+ * @param[in] erase_count The number of blocks to pre-erase if a new sequence
+ *   is started.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_write_block_seq(SdBlockDev* dev, uint32_t block,
+                                             const uint8_t* src,
+                                             uint32_t erase_count)
+{
+    if ((!dev->in_write_seq || dev->seq_block != block)
+            && !sd_block_dev_write_start(dev, block, erase_count)) {
+        return false;
+    }
+    return sd_block_dev_write_data_seq(dev, src);
+}
+
+
+/**
+ * Erase a range of blocks. This is advisory: backends without an erase
+ * operation, or that can't erase the range, leave the blocks as they are.
+ *
+ * @param[in] first_block The address of the first block in the range.
+ * @param[in] last_block The address of the last block in the range.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_erase(SdBlockDev* dev, uint32_t first_block,
+                                   uint32_t last_block)
+{
+    if (!sd_block_dev_end_seq(dev)) {
+        return false;
+    }
+    return !dev->erase || dev->erase(dev->ctx, first_block, last_block);
+}
+
+
+/**
+ * End any open sequence and wait until all written data is stored on the
+ * device.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_block_dev_sync(SdBlockDev* dev)
+{
+    if (!sd_block_dev_end_seq(dev)) {
+        return false;
+    }
+    return !dev->sync || dev->sync(dev->ctx);
+}
+#endif//SD_BLOCK_DEV_H
@@ -28,6 +28,11 @@
 #include "sangster/pinout.h"
 #include "sangster/timer0.h"
 #include "sangster/sd/fat_structs.h"
+#include "sangster/sd/sd_block_dev.h"
+#include "sangster/sd/sd_crc.h"
+#ifdef SD_CARD_STATS
+#include "sangster/usart.h"
+#endif
 
 // SD card commands
 
@@ -43,12 +48,18 @@
 /** SEND_CID - read the card identification information (CID register) */
 #define CMD10 0x0A
 
+/** STOP_TRANSMISSION - end multiple block read sequence */
+#define CMD12 0x0C
+
 /** SEND_STATUS - read the card status register */
 #define CMD13 0x0D
 
 /** READ_BLOCK - read a single data block from the card */
 #define CMD17 0x11
 
+/** READ_MULTIPLE_BLOCK - read blocks of data until a STOP_TRANSMISSION */
+#define CMD18 0x12
+
 /** WRITE_BLOCK - write a single data block to the card */
 #define CMD24 0x18
 
@@ -71,6 +82,9 @@
 /** READ_OCR - read the OCR register of a card */
 #define CMD58 0x3A
 
+/** CRC_ON_OFF - turn CRC checking on or off */
+#define CMD59 0x3B
+
 /** SET_WR_BLK_ERASE_COUNT - Set the number of write blocks to be
      pre-erased before writing */
 #define ACMD23 0x17
@@ -115,6 +129,16 @@
 /** Set SCK rate to F_CPU/8. sd_card_set_sck_rate(). */
 #define SPI_QUARTER_SPEED 2
 
+/**
+ * Number of log2 latency buckets kept by each SdCardStat. Bucket @a i counts
+ * latencies of [2^i, 2^(i+1)) microseconds, and the last bucket also counts
+ * anything longer.
+ */
+#define SD_CARD_STAT_BUCKETS 16
+
+/** Number of blocks read to verify each SCK rate tried by calibration */
+#define SD_SCK_VERIFY_READS 4
+
 /** init timeout ms */
 #define SD_INIT_TIMEOUT ((uint16_t) 2000)
 
@@ -194,6 +218,18 @@
 /** incorrect rate selected */
 #define SD_CARD_ERROR_SCK_RATE 0x16
 
+/** card returned an error response for CMD12 (stop transmission) */
+#define SD_CARD_ERROR_CMD12 0x17
+
+/** READ_MULTIPLE_BLOCKS command failed */
+#define SD_CARD_ERROR_CMD18 0x18
+
+/** card returned an error response for CMD59 (CRC on/off) */
+#define SD_CARD_ERROR_CMD59 0x19
+
+/** CRC16 of read data did not match the CRC sent by the card */
+#define SD_CARD_ERROR_READ_CRC 0x1A
+
 // card types
 /** Standard capacity V1 SD card */
 #define SD_CARD_TYPE_SD1 1
@@ -205,6 +241,32 @@
 #define SD_CARD_TYPE_SDHC 3
 
 
+#ifdef SD_CARD_STATS
+/** Latency statistics of one kind of SD card operation, in microseconds. */
+typedef struct sd_card_stat SdCardStat;
+struct sd_card_stat
+{
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint16_t histogram[SD_CARD_STAT_BUCKETS];
+};
+
+/** Counters kept by an SdCard when built with SD_CARD_STATS defined. */
+typedef struct sd_card_stats SdCardStats;
+struct sd_card_stats
+{
+    SdCardStat command;     // command sent until response received
+    SdCardStat start_block; // waiting for a read's start block token
+    SdCardStat busy;        // waiting for a write or erase to be programmed
+    SdCardStat ready;       // waiting for the card to be ready for a command
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+};
+#endif//SD_CARD_STATS
+
+
 typedef struct sd_card SdCard;
 struct sd_card
 {
@@ -220,9 +282,118 @@ struct sd_card
     uint8_t status;
     uint8_t type;
     uint8_t write_crc;
+    uint8_t check_crc;    // CMD59 CRC checking is on; verify read data
+    uint8_t in_read_seq;  // a CMD18 multiple block read is open
+    uint8_t in_write_seq; // a CMD25 multiple block write is open
+    uint32_t seq_block;   // next block of the open multiple block sequence
+    volatile uint8_t in_async; // a background transfer owns the bus
+    uint8_t defer_busy;   // don't wait for flash programming after a write
+    uint8_t busy;         // a deferred write is still programming flash
+    uint8_t sck_rate_id;  // current SPI clock rate. See sd_card_set_sck_rate()
+#ifdef SD_CARD_STATS
+    SdCardStats stats;
+#endif
 };
 
 
+#ifdef SD_CARD_STATS
+/** Start timing an operation, for SD_CARD_STAT_END() */
+#define SD_CARD_STAT_BEGIN() \
+    const uint16_t stat_ms = timer0_ms(); \
+    const uint16_t stat_us = timer0_us()
+
+/** Add the time since SD_CARD_STAT_BEGIN() to a SdCardStats member */
+#define SD_CARD_STAT_END(card, stat) \
+    sd_card_stat_add(&(card)->stats.stat, stat_ms, stat_us)
+
+/** Add to the bytes_read or bytes_written counter */
+#define SD_CARD_STAT_BYTES(card, counter, n) ((card)->stats.counter += (n))
+#else
+#define SD_CARD_STAT_BEGIN()
+#define SD_CARD_STAT_END(card, stat)
+#define SD_CARD_STAT_BYTES(card, counter, n)
+#endif//SD_CARD_STATS
+
+
+#ifdef SD_CARD_STATS
+/** Clear all statistics. */
+SA_FUNC void sd_card_stats_reset(SdCard* card)
+{
+    memset(&card->stats, 0, sizeof(SdCardStats));
+}
+
+
+/**
+ * Record the time since @a ms0 and @a us0, from timer0_ms() and timer0_us().
+ * timer0_us() wraps after 65 ms, so longer times are taken in milliseconds.
+ */
+SA_FUNC void sd_card_stat_add(SdCardStat* stat, uint16_t ms0, uint16_t us0)
+{
+    const uint16_t ms = timer0_ms() - ms0;
+    const uint32_t us = ms >= 60 ? ms * 1000UL : (uint16_t) (timer0_us() - us0);
+
+    if (stat->count == 0 || us < stat->min_us) {
+        stat->min_us = us;
+    }
+    if (us > stat->max_us) {
+        stat->max_us = us;
+    }
+    stat->count++;
+    stat->total_us += us;
+
+    uint8_t bucket = 0;
+    for (uint32_t v = us >> 1; v && bucket < SD_CARD_STAT_BUCKETS - 1; v >>= 1) {
+        bucket++;
+    }
+    stat->histogram[bucket]++;
+}
+
+
+// print one SdCardStat, see sd_card_stats_dump()
+SA_FUNC void sd_card_stat_dump(const char* name, const SdCardStat* stat)
+{
+    usart_print(name);
+    usart_print(": n=");
+    usart_32(stat->count);
+    usart_print(" min=");
+    usart_32(stat->min_us);
+    usart_print(" max=");
+    usart_32(stat->max_us);
+    usart_print(" avg=");
+    usart_32(stat->count ? stat->total_us / stat->count : 0);
+    usart_println(" us");
+
+    for (uint8_t i = 0; i < SD_CARD_STAT_BUCKETS; i++) {
+        if (stat->histogram[i]) {
+            usart_print("  >=");
+            usart_32(1UL << i);
+            usart_print(" us: ");
+            usart_16(stat->histogram[i]);
+            usart_crlf();
+        }
+    }
+}
+
+
+/**
+ * Print the statistics over USART: count, min, max and average latency of each
+ * kind of operation, its non-empty histogram buckets, and the bytes moved.
+ */
+SA_FUNC void sd_card_stats_dump(SdCard* card)
+{
+    sd_card_stat_dump("command", &card->stats.command);
+    sd_card_stat_dump("start block", &card->stats.start_block);
+    sd_card_stat_dump("busy", &card->stats.busy);
+    sd_card_stat_dump("ready", &card->stats.ready);
+    usart_print("read=");
+    usart_32(card->stats.bytes_read);
+    usart_print(" written=");
+    usart_32(card->stats.bytes_written);
+    usart_println(" bytes");
+}
+#endif//SD_CARD_STATS
+
+
 /** Skip remaining data in a block when in partial block read mode. */
 SA_FUNC void sd_card_read_end(SdCard* card)
 {
@@ -260,7 +431,7 @@ SA_INLINE uint8_t spi_rec()
 
 
 // wait for card to go not busy
-SA_FUNC uint8_t sd_card_wait_not_busy(uint16_t timeout_millis)
+SA_FUNC uint8_t sd_card_poll_not_busy(uint16_t timeout_millis)
 {
     const uint16_t t0 = timer0_ms();
 
@@ -275,32 +446,70 @@ SA_FUNC uint8_t sd_card_wait_not_busy(uint16_t timeout_millis)
 }
 
 
+// wait for a write or erase to be programmed, timed as stats.busy
+SA_FUNC uint8_t sd_card_wait_not_busy(SdCard* card, uint16_t timeout_millis)
+{
+    SD_CARD_STAT_BEGIN();
+    const uint8_t ok = sd_card_poll_not_busy(timeout_millis);
+    SD_CARD_STAT_END(card, busy);
+    return ok;
+}
+
+
+SA_FUNC uint8_t sd_card_read_stop(SdCard*);
+SA_FUNC uint8_t sd_card_write_stop(SdCard*);
+SA_FUNC uint8_t sd_card_finish_write(SdCard*);
+
+
 // send command and return error code.  Return zero for OK
 SA_FUNC uint8_t sd_card_card_command(SdCard* card, uint8_t cmd, uint32_t arg)
 {
+    while (card->in_async)             // wait for background transfer, see
+        ;                              // sd_async.h
     sd_card_read_end(card);            // end read if in partial_block_read mode
+    if (card->in_read_seq) {
+        sd_card_read_stop(card);       // end an open multiple block read
+    }
+    if (card->in_write_seq) {
+        sd_card_write_stop(card);      // end an open multiple block write
+    }
+    if (card->busy && !sd_card_finish_write(card)) {
+        return card->status = 0xFF;    // a deferred write failed
+    }
     pinout_clr(card->chip_select_pin); // select card
-    sd_card_wait_not_busy(300);        // wait up to 300 ms if busy
-    spi_send(cmd | 0x40);              // send command
+    {
+        // usually ready at once, so this is kept out of stats.busy
+        SD_CARD_STAT_BEGIN();
+        sd_card_poll_not_busy(300);    // wait up to 300 ms if busy
+        SD_CARD_STAT_END(card, ready);
+    }
+
+    SD_CARD_STAT_BEGIN();
+
+    // send command and argument, computing the CRC7 as each byte is shifted
+    SPDR = cmd | 0x40;
+    uint8_t crc = sd_crc7_update(0, cmd | 0x40);
+    loop_until_bit_is_set(SPSR, SPIF);
 
-    // send argument
     for (int8_t s = 24; s >= 0; s -= 8) {
-        spi_send(arg >> s);
+        const uint8_t b = arg >> s;
+        SPDR = b;
+        crc = sd_crc7_update(crc, b);
+        loop_until_bit_is_set(SPSR, SPIF);
     }
 
     // send CRC
-    uint8_t crc = 0xFF;
-    if (cmd == CMD0) {
-        crc = 0x95;  // correct crc for CMD0 with arg 0
-    }
-    if (cmd == CMD8) {
-        crc = 0x87;  // correct crc for CMD8 with arg 0x1AA
+    spi_send((crc << 1) | 0x01);
+
+    // skip stuff byte for stop read
+    if (cmd == CMD12) {
+        spi_rec();
     }
-    spi_send(crc);
 
     // wait for response
     for (uint8_t i = 0; ((card->status = spi_rec()) & 0x80) && i != 0xFF; i++)
         ;
+    SD_CARD_STAT_END(card, command);
     return card->status;
 }
 
@@ -340,6 +549,7 @@ SA_FUNC uint8_t sd_card_set_sck_rate(SdCard* card, uint8_t sck_rate_id)
     SPCR &= ~(_BV(SPR1) | _BV(SPR0));
     SPCR |= (sck_rate_id & 0x04 ? _BV(SPR1) : 0)
           | (sck_rate_id & 0x02 ? _BV(SPR0) : 0);
+    card->sck_rate_id = sck_rate_id;
     return true;
 }
 
@@ -357,10 +567,19 @@ SA_FUNC uint8_t sd_card_set_sck_rate(SdCard* card, uint8_t sck_rate_id)
 SA_FUNC uint8_t sd_card_init(SdCard* card, uint8_t sck_rate_id)
 {
     card->write_crc = 0;
+    card->check_crc = 0;
     card->error_code = 0;
     card->in_block = 0;
     card->partial_block_read = 0;
+    card->in_read_seq = 0;
+    card->in_write_seq = 0;
+    card->in_async = 0;
+    card->defer_busy = 0;
+    card->busy = 0;
     card->type = 0;
+#ifdef SD_CARD_STATS
+    sd_card_stats_reset(card);
+#endif
 
     timer0_start();
 
@@ -385,6 +604,7 @@ SA_FUNC uint8_t sd_card_init(SdCard* card, uint8_t sck_rate_id)
     // Enable SPI, Master, clock rate f_osc/128
     SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR1) | _BV(SPR0);
     SPSR &= ~_BV(SPI2X); // clear double speed
+    card->sck_rate_id = 6;
 
     // must supply min of 74 clock cycles with CS high.
     for (uint8_t i = 0; i < 10; ++i) {
@@ -473,14 +693,16 @@ SA_FUNC void sd_card_partial_block_read(SdCard* card, uint8_t value)
 /** Wait for start block token */
 SA_FUNC uint8_t sd_card_wait_start_block(SdCard* card)
 {
-    timer0_reset();
+    SD_CARD_STAT_BEGIN();
     uint16_t t0 = timer0_ms();
     while ((card->status = spi_rec()) == 0xFF) {
         if (timer0_ms() - t0 > SD_READ_TIMEOUT) {
             card->error_code = SD_CARD_ERROR_READ_TIMEOUT;
+            SD_CARD_STAT_END(card, start_block);
             goto fail;
         }
     }
+    SD_CARD_STAT_END(card, start_block);
     if (card->status != DATA_START_BLOCK) {
         card->error_code = SD_CARD_ERROR_READ;
         goto fail;
@@ -493,6 +715,58 @@ fail:
 }
 
 
+/**
+ * Receive @a count data bytes and the CRC16 that follows them. If @a check is
+ * set, the CRC is computed while each next byte is shifted in, and checked.
+ *
+ * @param[out] dst Where to store the data, or NULL to only check its CRC.
+ */
+SA_FUNC uint8_t sd_card_rec_data_crc(SdCard* card, uint8_t* dst,
+                                     uint16_t count, uint8_t check)
+{
+    uint16_t crc = 0;
+
+    SPDR = 0xFF; // start first spi transfer
+    if (check) {
+        for (uint16_t i = 0; i < count; i++) {
+            loop_until_bit_is_set(SPSR, SPIF);
+            const uint8_t b = SPDR;
+            SPDR = 0xFF;
+            if (dst) {
+                dst[i] = b;
+            }
+            crc = sd_crc16_update(crc, b);
+        }
+    } else {
+        for (uint16_t i = 0; i < count; i++) {
+            loop_until_bit_is_set(SPSR, SPIF);
+            dst[i] = SPDR;
+            SPDR = 0xFF;
+        }
+    }
+    // the last transfer started was the first CRC byte
+    loop_until_bit_is_set(SPSR, SPIF);
+    uint16_t card_crc = SPDR << 8;
+    card_crc |= spi_rec();
+
+    if (check && crc != card_crc) {
+        card->error_code = SD_CARD_ERROR_READ_CRC;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Receive @a count data bytes and the CRC16 that follows them. The CRC is
+ * checked if CRC checking is on.
+ */
+SA_INLINE uint8_t sd_card_rec_data(SdCard* card, uint8_t* dst, uint16_t count)
+{
+    return sd_card_rec_data_crc(card, dst, count, card->check_crc);
+}
+
+
 /**
  * Read part of a 512 byte block from an SD card.
  *
@@ -500,6 +774,10 @@ fail:
  * @param[in] offset Number of bytes to skip at start of block
  * @param[out] dst Pointer to the location that will receive the data.
  * @param[in] count Number of bytes to read
+ *
+ * @note When CRC checking is on (see sd_card_check_crc()), the CRC is only
+ *   verified for reads of a whole block.
+ *
  * @return The value one, true, is returned for success and the value zero,
  *   false, is returned for failure.
  */
@@ -530,6 +808,17 @@ SA_FUNC uint8_t sd_card_read_data(SdCard* card, uint32_t block, uint16_t offset,
         card->in_block = 1;
     }
 
+    if (card->check_crc && count == 512) {
+        // whole block, so the CRC can be checked
+        card->in_block = 0;
+        if (!sd_card_rec_data(card, dst, 512)) {
+            goto fail;
+        }
+        pinout_set(card->chip_select_pin);
+        SD_CARD_STAT_BYTES(card, bytes_read, 512);
+        return true;
+    }
+
     SPDR = 0xFF; // start first spi transfer
 
     // skip data before offset
@@ -548,6 +837,7 @@ SA_FUNC uint8_t sd_card_read_data(SdCard* card, uint32_t block, uint16_t offset,
     dst[n] = SPDR;
 
     card->offset += count;
+    SD_CARD_STAT_BYTES(card, bytes_read, count);
     if (!card->partial_block_read || card->offset >= 512) {
         // read rest of data, checksum and set chip select high
         sd_card_read_end(card);
@@ -576,38 +866,141 @@ SA_INLINE uint8_t sd_card_read_block(SdCard* card, uint32_t block,
 }
 
 
+/**
+ * Start a read multiple blocks sequence.
+ *
+ * @param[in] block_number Address of first block in sequence.
+ *
+ * @note This function is used with sd_card_read_data_seq() and
+ *   sd_card_read_stop() for optimized multiple block reads. The SPI SS line
+ *   will be held low until sd_card_read_stop() is called, or until any other
+ *   command is sent to the card, which ends the sequence first.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_read_start(SdCard* card, uint32_t block_number)
+{
+    card->seq_block = block_number;
+
+    // use address if not SDHC card
+    if (card->type != SD_CARD_TYPE_SDHC) {
+        block_number <<= 9;
+    }
+    if (sd_card_card_command(card, CMD18, block_number)) {
+        card->error_code = SD_CARD_ERROR_CMD18;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    card->in_read_seq = 1;
+    return true;
+}
+
+
+/**
+ * Read the next 512 byte block of a read multiple blocks sequence.
+ *
+ * @param[out] dst Pointer to the location that will receive the data.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_read_data_seq(SdCard* card, uint8_t* dst)
+{
+    if (!card->in_read_seq) {
+        return false;
+    }
+    if (!sd_card_wait_start_block(card) || !sd_card_rec_data(card, dst, 512)) {
+        // stop the card streaming data into the next command, keeping the
+        // read's error code
+        const uint8_t error_code = card->error_code;
+        sd_card_read_stop(card);
+        card->error_code = error_code;
+        return false;
+    }
+    card->seq_block++;
+    SD_CARD_STAT_BYTES(card, bytes_read, 512);
+    return true;
+}
+
+
+/**
+ * End a read multiple blocks sequence.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_read_stop(SdCard* card)
+{
+    card->in_read_seq = 0;
+    if (sd_card_card_command(card, CMD12, 0)) {
+        card->error_code = SD_CARD_ERROR_CMD12;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    pinout_set(card->chip_select_pin);
+    return true;
+}
+
+
+/**
+ * Read a 512 byte block, continuing the open read multiple blocks sequence if
+ * @a block_number is the next block in it, or starting a new sequence at
+ * @a block_number otherwise.
+ *
+ * Reading consecutive blocks this way avoids the command and start-block
+ * latency of a CMD17 for each one.
+ *
+ * @param[in] block_number Logical block to be read.
+ * @param[out] dst Pointer to the location that will receive the data.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_read_block_seq(SdCard* card, uint32_t block_number,
+                                       uint8_t* dst)
+{
+    if (!card->in_read_seq || card->seq_block != block_number) {
+        if (!sd_card_read_start(card, block_number)) {
+            return false;
+        }
+    }
+    return sd_card_read_data_seq(card, dst);
+}
+
+
 // send one block of data for write block or write multiple blocks
 SA_FUNC uint8_t sd_card_write_data(SdCard* card, uint8_t token,
                                   const uint8_t* src)
 {
     // CRC16 checksum is supposed to be ignored in SPI mode (unless explicitly
     // enabled) and a dummy value is normally written.  A few funny cards (e.g.
-    // Eye-Fi X2) expect a valid CRC anyway.  Call setCRC(true) to enable CRC16
-    // checksum on block writes.  This has a noticeable impact on write speed.
-    // :(
-    int16_t crc;
-    if(card->write_crc) {
-        int16_t i, x;
-        // CRC16 code via Scott Dattalo www.dattalo.com
-        for(crc = i = 0; i < 512; i++) {
-            x   = ((crc >> 8) ^ src[i]) & 0xff;
-            x  ^= x >> 4;
-            crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
-        }
-    } else {
-        crc = 0xffff; // Dummy CRC value
-    }
+    // Eye-Fi X2) expect a valid CRC anyway.  Set write_crc to enable CRC16
+    // checksum on block writes. It is computed from a table while each byte is
+    // shifted out, so it costs little write speed.
+    uint16_t crc = 0xFFFF; // Dummy CRC value
 
     SPDR = token; // send data - optimized loop
 
-    // send two byte per iteration
-    for (uint16_t i = 0; i < 512; i += 2) {
-        while (!(SPSR & _BV(SPIF)))
-            ;
-        SPDR = src[i];
-        while (!(SPSR & _BV(SPIF)))
-            ;
-        SPDR = src[i + 1];
+    if (card->write_crc) {
+        crc = 0;
+        for (uint16_t i = 0; i < 512; i++) {
+            const uint8_t b = src[i];
+            while (!(SPSR & _BV(SPIF)))
+                ;
+            SPDR = b;
+            crc = sd_crc16_update(crc, b);
+        }
+    } else {
+        // send two byte per iteration
+        for (uint16_t i = 0; i < 512; i += 2) {
+            while (!(SPSR & _BV(SPIF)))
+                ;
+            SPDR = src[i];
+            while (!(SPSR & _BV(SPIF)))
+                ;
+            SPDR = src[i + 1];
+        }
     }
 
     // wait for last data byte
@@ -623,6 +1016,7 @@ SA_FUNC uint8_t sd_card_write_data(SdCard* card, uint8_t token,
         pinout_set(card->chip_select_pin);
         return false;
     }
+    SD_CARD_STAT_BYTES(card, bytes_written, 512);
     return true;
 }
 
@@ -650,8 +1044,53 @@ SA_FUNC uint8_t sd_card_write_block(SdCard* card, uint32_t block_number,
         goto fail;
     }
 
+    if (card->defer_busy) {
+        // let the caller work while the card programs flash. The next
+        // command will wait for it, see sd_card_finish_write()
+        card->busy = 1;
+        pinout_set(card->chip_select_pin);
+        return true;
+    }
+
     // wait for flash programming to complete
-    if (!sd_card_wait_not_busy(SD_WRITE_TIMEOUT)) {
+    if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
+        card->error_code = SD_CARD_ERROR_WRITE_TIMEOUT;
+        goto fail;
+    }
+    // response is r2 so get and check two bytes for nonzero
+    if (sd_card_card_command(card, CMD13, 0) || spi_rec()) {
+        card->error_code = SD_CARD_ERROR_WRITE_PROGRAMMING;
+        goto fail;
+    }
+    pinout_set(card->chip_select_pin);
+    return true;
+
+fail:
+    pinout_set(card->chip_select_pin);
+    return false;
+}
+
+
+/**
+ * Wait for a deferred write to finish programming flash, then check the card
+ * status for programming errors.
+ *
+ * This is called by the next command sent to the card, so it normally only
+ * needs to be called directly to be sure that written data is safe on the
+ * card.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_finish_write(SdCard* card)
+{
+    if (!card->busy) {
+        return true;
+    }
+    card->busy = 0;
+
+    pinout_clr(card->chip_select_pin);
+    if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
         card->error_code = SD_CARD_ERROR_WRITE_TIMEOUT;
         goto fail;
     }
@@ -669,16 +1108,66 @@ fail:
 }
 
 
+/**
+ * Check, without waiting, if the card is still programming flash for a
+ * deferred write.
+ *
+ * @return The value one, true, is returned if the card is busy.
+ */
+SA_FUNC uint8_t sd_card_is_busy(SdCard* card)
+{
+    if (!card->busy) {
+        return false;
+    }
+    pinout_clr(card->chip_select_pin);
+    const uint8_t busy = spi_rec() != 0xFF;
+    pinout_set(card->chip_select_pin);
+    return busy;
+}
+
+
+/**
+ * Enable or disable deferred busy waiting.
+ *
+ * Normally, sd_card_write_block() and sd_card_write_stop() wait up to
+ * SD_WRITE_TIMEOUT for the card to program flash before they return. With
+ * deferred busy waiting they return as soon as the card accepts the data,
+ * and the card remembers that it is busy. The wait, and the CMD13 status
+ * check, happen when the next command is sent, leaving the 1-100 ms of
+ * programming time to the caller.
+ *
+ * A failed deferred write is reported as the failure of the next command.
+ *
+ * @param[in] value The value TRUE (non-zero) or FALSE (zero).
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned if a deferred write failed while disabling.
+ */
+SA_FUNC uint8_t sd_card_defer_busy(SdCard* card, uint8_t value)
+{
+    card->defer_busy = value;
+    return value ? true : sd_card_finish_write(card);
+}
+
+
 /** Write one data block in a multiple block write sequence */
 SA_FUNC uint8_t sd_card_write_data_seq(SdCard* card, const uint8_t* src)
 {
     // wait for previous write to finish
-    if (!sd_card_wait_not_busy(SD_WRITE_TIMEOUT)) {
+    if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
         card->error_code = SD_CARD_ERROR_WRITE_MULTIPLE;
-        pinout_set(card->chip_select_pin);
-        return false;
+        goto fail;
     }
-    return sd_card_write_data(card, WRITE_MULTIPLE_TOKEN, src);
+    if (!sd_card_write_data(card, WRITE_MULTIPLE_TOKEN, src)) {
+        goto fail;
+    }
+    card->seq_block++;
+    return true;
+
+fail:
+    card->in_write_seq = 0;
+    pinout_set(card->chip_select_pin);
+    return false;
 }
 
 
@@ -692,12 +1181,9 @@ SA_FUNC uint8_t sd_card_read_register(SdCard* card, uint8_t cmd, uint8_t* dst)
     if (!sd_card_wait_start_block(card)) {
         goto fail;
     }
-    // transfer data
-    for (uint16_t i = 0; i < 16; i++) {
-        dst[i] = spi_rec();
+    if (!sd_card_rec_data(card, dst, 16)) {
+        goto fail;
     }
-    spi_rec(); // get first crc byte
-    spi_rec(); // get second crc byte
 
     pinout_set(card->chip_select_pin);
     return true;
@@ -750,6 +1236,111 @@ SA_FUNC uint32_t sd_card_size(SdCard* card)
 }
 
 
+/**
+ * Decode the TRAN_SPEED field of the CSD register.
+ *
+ * @return The maximum data transfer rate of the card in kbit/s, or zero if the
+ *   field is reserved.
+ */
+SA_FUNC uint32_t sd_card_tran_speed_khz(const SdCsd* csd)
+{
+    // time values, times ten, indexed by bits 6:3
+    static const uint8_t time_value[16] = {
+        0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+    };
+    // tran_speed is at the same position in both CSD versions
+    const uint8_t tran_speed = csd->v1.tran_speed;
+    uint8_t unit = tran_speed & 0x07; // 0: 100 kbit/s ... 3: 100 Mbit/s
+    if (unit > 3) {
+        return 0;
+    }
+    uint32_t khz = time_value[(tran_speed >> 3) & 0x0F] * 10UL;
+    while (unit--) {
+        khz *= 10;
+    }
+    return khz;
+}
+
+
+/**
+ * Read a block and check its CRC16 without storing the data.
+ *
+ * @param[in] block Logical block to be read.
+ *
+ * @return The value one, true, is returned if the block was read with a good
+ *   CRC and the value zero, false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_verify_block(SdCard* card, uint32_t block)
+{
+    card->block = block;
+    // use address if not SDHC card
+    if (card->type != SD_CARD_TYPE_SDHC) {
+        block <<= 9;
+    }
+    if (sd_card_card_command(card, CMD17, block)) {
+        card->error_code = SD_CARD_ERROR_CMD17;
+        goto fail;
+    }
+    if (!sd_card_wait_start_block(card)
+            || !sd_card_rec_data_crc(card, NULL, 512, true)) {
+        goto fail;
+    }
+    pinout_set(card->chip_select_pin);
+    return true;
+
+fail:
+    pinout_set(card->chip_select_pin);
+    return false;
+}
+
+
+/**
+ * Raise the SPI clock to the fastest rate the card supports.
+ *
+ * The maximum rate is taken from the TRAN_SPEED field of the CSD. Starting at
+ * the current rate, the clock is doubled while it is within that maximum, and
+ * each new rate is checked with SD_SCK_VERIFY_READS CRC-verified block reads.
+ * The first rate to fail verification is backed off from, and the rate reached
+ * is recorded in SdCard::sck_rate_id. If TRAN_SPEED is reserved, the clock is
+ * only raised to SPI_HALF_SPEED, the rate used before calibration existed.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned if the CSD could not be read.
+ */
+SA_FUNC uint8_t sd_card_calibrate_sck_rate(SdCard* card)
+{
+    SdCsd csd;
+    if (!sd_card_read_csd(card, &csd)) {
+        return false;
+    }
+    const uint32_t max_khz = sd_card_tran_speed_khz(&csd);
+    if (max_khz == 0) {
+        if (card->sck_rate_id > SPI_HALF_SPEED) {
+            sd_card_set_sck_rate(card, SPI_HALF_SPEED);
+        }
+        return true;
+    }
+
+    while (card->sck_rate_id > SPI_FULL_SPEED) {
+        const uint8_t rate_id = card->sck_rate_id - 1;
+        if ((F_CPU / 1000UL) >> (rate_id + 1) > max_khz) {
+            break;
+        }
+        const uint8_t prev_rate_id = card->sck_rate_id;
+        sd_card_set_sck_rate(card, rate_id);
+
+        for (uint8_t i = 0; i < SD_SCK_VERIFY_READS; i++) {
+            if (!sd_card_verify_block(card, i)) {
+                sd_card_set_sck_rate(card, prev_rate_id);
+                card->error_code = 0;
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+
 /**
  * Determine if card supports single block erase.
  *
@@ -793,7 +1384,7 @@ SA_FUNC uint8_t sd_card_erase(SdCard* card, uint32_t first_block,
         card->error_code = SD_CARD_ERROR_ERASE;
         goto fail;
     }
-    if (!sd_card_wait_not_busy(SD_ERASE_TIMEOUT)) {
+    if (!sd_card_wait_not_busy(card, SD_ERASE_TIMEOUT)) {
         card->error_code = SD_CARD_ERROR_ERASE_TIMEOUT;
         goto fail;
     }
@@ -822,6 +1413,8 @@ fail:
 SA_FUNC uint8_t sd_card_write_start(SdCard* card, uint32_t block_number,
                                    uint32_t erase_count)
 {
+    card->seq_block = block_number;
+
     // send pre-erase count
     if (app_command(card, ACMD23, erase_count)) {
         card->error_code = SD_CARD_ERROR_ACMD23;
@@ -835,7 +1428,7 @@ SA_FUNC uint8_t sd_card_write_start(SdCard* card, uint32_t block_number,
         card->error_code = SD_CARD_ERROR_CMD25;
         goto fail;
     }
-
+    card->in_write_seq = 1;
     return true;
 
 fail:
@@ -852,11 +1445,14 @@ fail:
  */
 SA_FUNC uint8_t sd_card_write_stop(SdCard* card)
 {
-    if (!sd_card_wait_not_busy(SD_WRITE_TIMEOUT)) {
+    card->in_write_seq = 0;
+    if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
         goto fail;
     }
     spi_send(STOP_TRAN_TOKEN);
-    if (!sd_card_wait_not_busy(SD_WRITE_TIMEOUT)) {
+    if (card->defer_busy) {
+        card->busy = 1;
+    } else if (!sd_card_wait_not_busy(card, SD_WRITE_TIMEOUT)) {
         goto fail;
     }
 
@@ -868,4 +1464,169 @@ fail:
     pinout_set(card->chip_select_pin);
     return false;
 }
+
+
+/**
+ * Write a 512 byte block, continuing the open write multiple blocks sequence
+ * if @a block_number is the next block in it, or starting a new sequence at
+ * @a block_number otherwise.
+ *
+ * @param[in] block_number Logical block to be written.
+ * @param[in] src Pointer to the location of the data to be written.
+ * @param[in] erase_count The number of blocks to be pre-erased if a new
+ *   sequence is started.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_write_block_seq(SdCard* card, uint32_t block_number,
+                                        const uint8_t* src,
+                                        uint32_t erase_count)
+{
+    if (!card->in_write_seq || card->seq_block != block_number) {
+        if (!sd_card_write_start(card, block_number, erase_count)) {
+            return false;
+        }
+    }
+    return sd_card_write_data_seq(card, src);
+}
+
+
+/**
+ * Turn CRC checking on or off with CMD59.
+ *
+ * When on, the card rejects commands and written data with a bad CRC, so
+ * write_crc is also enabled, and the CRC16 of each whole block read is
+ * checked against the one sent by the card. All CRCs are computed as the
+ * bytes are shifted, rather than in a separate pass.
+ *
+ * Turning it off turns write_crc off too. Set write_crc again afterwards for
+ * cards that want a write CRC regardless.
+ *
+ * @param[in] value The value TRUE (non-zero) or FALSE (zero).
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_card_check_crc(SdCard* card, uint8_t value)
+{
+    if (sd_card_card_command(card, CMD59, value ? 1 : 0)) {
+        card->error_code = SD_CARD_ERROR_CMD59;
+        pinout_set(card->chip_select_pin);
+        return false;
+    }
+    pinout_set(card->chip_select_pin);
+
+    card->check_crc = value ? 1 : 0;
+    card->write_crc = card->check_crc;
+    return true;
+}
+
+
+// SdBlockDev operations for an SD card. See sd_card_block_dev()
+SA_FUNC uint8_t sd_card_dev_read(void* ctx, uint32_t block, uint16_t offset,
+                                 uint16_t count, uint8_t* dst)
+{
+    return sd_card_read_data((SdCard*) ctx, block, offset, count, dst);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_write(void* ctx, uint32_t block, const uint8_t* src)
+{
+    return sd_card_write_block((SdCard*) ctx, block, src);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_read_start(void* ctx, uint32_t block)
+{
+    return sd_card_read_start((SdCard*) ctx, block);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_read_data(void* ctx, uint8_t* dst)
+{
+    SdCard* card = (SdCard*) ctx;
+
+    // another command may have ended the sequence; carry on where it stopped
+    if (!card->in_read_seq && !sd_card_read_start(card, card->seq_block)) {
+        return false;
+    }
+    return sd_card_read_data_seq(card, dst);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_read_stop(void* ctx)
+{
+    SdCard* card = (SdCard*) ctx;
+    return !card->in_read_seq || sd_card_read_stop(card);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_write_start(void* ctx, uint32_t block,
+                                        uint32_t erase_count)
+{
+    return sd_card_write_start((SdCard*) ctx, block, erase_count);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_write_data(void* ctx, const uint8_t* src)
+{
+    SdCard* card = (SdCard*) ctx;
+
+    // another command may have ended the sequence; carry on where it stopped
+    if (!card->in_write_seq && !sd_card_write_start(card, card->seq_block, 1)) {
+        return false;
+    }
+    return sd_card_write_data_seq(card, src);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_write_stop(void* ctx)
+{
+    SdCard* card = (SdCard*) ctx;
+    return !card->in_write_seq || sd_card_write_stop(card);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_erase(void* ctx, uint32_t first_block,
+                                  uint32_t last_block)
+{
+    SdCard* card = (SdCard*) ctx;
+
+    // erase is advisory, so skip it on cards that can only erase whole sectors
+    if (!sd_card_erase_single_block_enable(card)) {
+        return true;
+    }
+    return sd_card_erase(card, first_block, last_block);
+}
+
+
+SA_FUNC uint8_t sd_card_dev_sync(void* ctx)
+{
+    return sd_card_finish_write((SdCard*) ctx);
+}
+
+
+/**
+ * Set up a block device for an initialized SD card, so a FAT volume can be
+ * mounted from it. See sd_volume_init().
+ *
+ * @param[out] dev The block device.
+ * @param[in] card The SD card, which must outlive @a dev.
+ */
+SA_FUNC void sd_card_block_dev(SdBlockDev* dev, SdCard* card)
+{
+    sd_block_dev_init(dev);
+    dev->ctx = card;
+    dev->read = sd_card_dev_read;
+    dev->write = sd_card_dev_write;
+    dev->read_start = sd_card_dev_read_start;
+    dev->read_data = sd_card_dev_read_data;
+    dev->read_stop = sd_card_dev_read_stop;
+    dev->write_start = sd_card_dev_write_start;
+    dev->write_data = sd_card_dev_write_data;
+    dev->write_stop = sd_card_dev_write_stop;
+    dev->erase = sd_card_dev_erase;
+    dev->sync = sd_card_dev_sync;
+}
 #endif//SD_CARD_H
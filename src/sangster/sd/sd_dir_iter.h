@@ -0,0 +1,199 @@
+#ifndef SD_DIR_ITER_H
+#define SD_DIR_ITER_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * An iterator over the files and subdirectories of a directory. Rather than
+ * reading one entry at a time with sd_file_read(), like sd_file_ls() does, it
+ * tests the 16 entries of each cached directory block in place against a
+ * filter, and returns the ones that match:
+ *
+ *     SdDirFilter filter = {
+ *         .ext = "CSV",
+ *         .date_min = FAT_DATE(2018, 1, 1),
+ *     };
+ *     SdDirIter iter;
+ *     SdDir* entry;
+ *     uint16_t index;
+ *
+ *     sd_dir_iter_open(&iter, &dir, &filter);
+ *     while ((entry = sd_dir_iter_next(&iter, &index))) {
+ *         index_file(entry->name, entry->file_size);
+ *     }
+ *
+ * Entries that are deleted, '.', '..', long name parts or the volume label
+ * are always skipped. The iterator keeps its place in the directory's
+ * position, so the directory mustn't be read or seeked during the iteration,
+ * except by sd_file_open_by_index() of the entry just returned.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+#include "sangster/api.h"
+#include "sangster/sd/fat_structs.h"
+#include "sangster/sd/sd_file.h"
+#include "sangster/sd/sd_volume.h"
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+/** An extra test of an entry, see SdDirFilter */
+typedef bool (*SdDirFilterFunc)(const SdDir* entry, void* object);
+
+/**
+ * What sd_dir_iter_next() returns. A zeroed filter matches every entry.
+ */
+typedef struct sd_dir_filter SdDirFilter;
+struct sd_dir_filter
+{
+    const char* ext;      // extension, e.g. "CSV", or NULL for any
+    uint8_t attr_mask;    // DIR_ATT_* bits that must equal attr_value
+    uint8_t attr_value;
+    uint16_t date_min;    // FAT_DATE() bounds of the last write, 0 for none
+    uint16_t date_max;
+    SdDirFilterFunc func; // called last, or NULL for none
+    void* object;         // passed to func
+};
+
+typedef struct sd_dir_iter SdDirIter;
+struct sd_dir_iter
+{
+    SdFile* dir;
+    const SdDirFilter* filter;
+    uint8_t ext[3];       // filter->ext as in SdDir::name, space padded
+    uint32_t block;       // device block of the directory's position
+    uint8_t done;         // the last entry was reached
+    uint8_t error;        // an I/O error stopped the iteration
+};
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+/**
+ * Start iterating over a directory, from its first entry.
+ *
+ * @param[in] dir An open directory. Its position is used by the iterator.
+ * @param[in] filter The entries to return, or NULL for all of them. It must
+ *   stay valid until the iteration ends.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_dir_iter_open(SdDirIter* iter, SdFile* dir,
+                                 const SdDirFilter* filter)
+{
+    if (!sd_file_is_dir(dir)) {
+        return false;
+    }
+    iter->dir = dir;
+    iter->filter = filter;
+    iter->done = false;
+    iter->error = false;
+
+    // pad the extension like an 8.3 name, so it's compared with memcmp()
+    memset(iter->ext, ' ', sizeof(iter->ext));
+    if (filter && filter->ext) {
+        for (uint8_t i = 0; i < sizeof(iter->ext) && filter->ext[i]; i++) {
+            iter->ext[i] = toupper(filter->ext[i]);
+        }
+    }
+    sd_file_rewind(dir);
+    return true;
+}
+
+
+// Does @a p pass the filter of @a iter?
+SA_FUNC bool sd_dir_iter_match(SdDirIter* iter, const SdDir* p)
+{
+    const SdDirFilter* filter = iter->filter;
+    if (!filter) {
+        return true;
+    }
+    if (filter->ext && memcmp(p->name + 8, iter->ext, sizeof(iter->ext))) {
+        return false;
+    }
+    if ((p->attributes & filter->attr_mask) != filter->attr_value) {
+        return false;
+    }
+    if ((filter->date_min && p->last_write_date < filter->date_min)
+            || (filter->date_max && p->last_write_date > filter->date_max)) {
+        return false;
+    }
+    return !filter->func || filter->func(p, filter->object);
+}
+
+
+/**
+ * Find the next entry that matches the filter. The entry is in the block
+ * cache, so it's only valid until the volume is used again, e.g. to open it.
+ *
+ * @param[out] index Set to the index of the entry in the directory, for
+ *   sd_file_open_by_index(). May be NULL.
+ *
+ * @return The entry, or NULL after the last entry or an I/O error. See
+ *   SdDirIter::error.
+ */
+SA_FUNC SdDir* sd_dir_iter_next(SdDirIter* iter, uint16_t* index)
+{
+    SdFile* dir = iter->dir;
+
+    while (!iter->done && dir->cur_position < dir->file_size) {
+        uint8_t i = 0xF & (dir->cur_position >> 5);
+        if (i == 0 && !sd_file_cur_block(dir, &iter->block)) {
+            break;
+        }
+        // the block may have been evicted since the last call
+        SdCache* cache = sd_volume_cache_raw_block(iter->block, CACHE_FOR_READ);
+        if (!cache) {
+            break;
+        }
+
+        // test the rest of the block in place
+        for (; i < 16 && dir->cur_position < dir->file_size; i++) {
+            SdDir* p = cache->dir + i;
+            dir->cur_position += sizeof(SdDir);
+
+            if (p->name[0] == DIR_NAME_FREE) {
+                iter->done = true; // no entries follow
+                return NULL;
+            }
+            if (p->name[0] == DIR_NAME_DELETED || p->name[0] == '.'
+                    || !DIR_IS_FILE_OR_SUBDIR(p)) {
+                continue;
+            }
+            if (sd_dir_iter_match(iter, p)) {
+                if (index) {
+                    *index = (dir->cur_position >> 5) - 1;
+                }
+                return p;
+            }
+        }
+    }
+
+    if (!iter->done && dir->cur_position < dir->file_size) {
+        iter->error = true;
+    }
+    iter->done = true;
+    return NULL;
+}
+#endif//SD_DIR_ITER_H
@@ -25,12 +25,23 @@
 
 #include <stdbool.h>
 #include <string.h>
-#include <avr/pgmspace.h>
 #include "sangster/api.h"
-#include "sangster/usart.h"
 #include "sangster/sd/fat_structs.h"
 #include "sangster/sd/sd_volume.h"
 
+#ifdef __AVR__
+#include <stdio.h>
+#include <avr/pgmspace.h>
+#include "sangster/timer0.h"
+#include "sangster/usart.h"
+#else
+// host builds, e.g. over sd_image_disk.h, have no separate program memory
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*) (p))
+#define _BV(bit) (1 << (bit))
+#endif//__AVR__
+
 
 // flags for ls()
 /** ls() flag to print modify date */
@@ -88,6 +99,21 @@
 /** Set the file's write date and time */
 #define T_WRITE 4
 
+#ifdef SD_FILE_COMMIT
+// commit policies, see sd_file_set_commit()
+/** only sync when sd_file_sync() or sd_file_close() is called */
+#define SD_COMMIT_EXPLICIT 0
+
+/** sync after every N bytes written */
+#define SD_COMMIT_BYTES 1
+
+/** sync on the first write M milliseconds after the last sync (AVR only) */
+#define SD_COMMIT_MS 2
+
+/** sync after each write that completes a block */
+#define SD_COMMIT_BLOCK 3
+#endif
+
 
 // values for type_
 /** This SdFile has not been opened. */
@@ -118,8 +144,10 @@
 // bits defined in flags
 // should be 0xF
 #define F_OFLAG (O_ACCMODE | O_APPEND | O_SYNC)
-// available bits
-#define F_UNUSED 0x30
+// raw contiguous capture is in progress. See sd_file_capture_start()
+#define F_FILE_CAPTURE 0x10
+// keep a multiple block write open for full block writes
+#define F_FILE_MULTI_BLOCK_WRITE 0x20
 // use unbuffered SD read
 #define F_FILE_UNBUFFERED_READ 0x40
 // sync of directory entry required
@@ -128,6 +156,20 @@
 typedef void (*SdFileDateTime)(uint16_t* date, uint16_t* time);
 SdFileDateTime sd_date_time_callback;
 
+#ifdef SD_FILE_EXTENTS
+/**
+ * A run of contiguous clusters in a file's cluster chain. Define
+ * SD_FILE_EXTENTS as the number of runs each SdFile remembers, so that seeks
+ * and cluster changes inside them don't read the FAT.
+ */
+typedef struct sd_file_extent SdFileExtent;
+struct sd_file_extent
+{
+    uint32_t index;   // position of the run's first cluster in the chain
+    uint32_t cluster; // first cluster of the run
+};
+#endif
+
 /**
  * @class sd_file
  * @brief Access FAT16 and FAT32 files on SD and SDHC cards.
@@ -146,10 +188,34 @@ struct sd_file
     uint32_t first_cluster;  // first cluster of file
     SdVolume* vol;           // volume where file is located
     uint8_t write_error;
+#ifdef SD_FILE_CAPTURE
+    uint32_t capture_blocks; // blocks reserved by sd_file_capture_start()
+#endif
+#ifdef SD_FILE_EXTENTS
+    SdFileExtent extents[SD_FILE_EXTENTS]; // known runs, from the chain start
+    uint8_t extent_count;    // number of runs in extents
+    uint32_t extent_end;     // number of chain clusters covered by extents
+#endif
+#ifdef SD_FILE_COMMIT
+    uint8_t commit_policy;   // SD_COMMIT_*, see sd_file_set_commit()
+    uint32_t commit_every;   // bytes or milliseconds between syncs
+    uint32_t commit_bytes;   // bytes written since the last sync
+    uint16_t commit_ms;      // timer0_ms() at the last sync
+#endif
+#ifdef SD_FILE_WRITE_BUFFER
+    uint8_t* write_buf;      // see sd_file_set_write_buffer(), or NULL
+    uint16_t write_buf_size;
+    uint16_t write_buf_len;  // bytes buffered, which end at cur_position
+    uint16_t write_buf_grow; // buffered bytes past the written end of file
+#endif
 
     SdFileDateTime date_time;
 };
 
+#ifdef SD_FILE_WRITE_BUFFER
+SA_FUNC uint8_t sd_file_write_buffer_flush(SdFile*);
+#endif
+
 
 /** Initialize a new SdFile object.  */
 SA_INLINE void sd_file_init(SdFile* file)
@@ -157,6 +223,21 @@ SA_INLINE void sd_file_init(SdFile* file)
     file->type = FAT_FILE_TYPE_CLOSED;
     file->date_time = NULL;
     file->write_error = 0;
+#ifdef SD_FILE_CAPTURE
+    file->capture_blocks = 0;
+#endif
+#ifdef SD_FILE_EXTENTS
+    file->extent_count = 0;
+    file->extent_end = 0;
+#endif
+#ifdef SD_FILE_COMMIT
+    file->commit_policy = SD_COMMIT_EXPLICIT;
+#endif
+#ifdef SD_FILE_WRITE_BUFFER
+    file->write_buf = NULL;
+    file->write_buf_len = 0;
+    file->write_buf_grow = 0;
+#endif
 }
 
 
@@ -223,6 +304,30 @@ SA_INLINE uint8_t sd_file_unbuffered_read(SdFile* file)
 }
 
 
+/**
+ * Enable or disable multiple block writes.
+ *
+ * While enabled, full 512 byte block writes keep one CMD25 write multiple
+ * blocks sequence open for as long as they stay in contiguous blocks, instead
+ * of paying for a CMD24, a flash programming wait, and a CMD13 status check
+ * per block. The sequence is ended by sd_file_seek_set(), sd_file_sync(),
+ * sd_file_close(), or by any other access to the card.
+ *
+ * The SPI SS line will be held low while a sequence is open.
+ *
+ * @param[in] value The value TRUE (non-zero) or FALSE (zero).
+ */
+SA_FUNC void sd_file_multi_block_write(SdFile* file, uint8_t value)
+{
+    if (value) {
+        file->flags |= F_FILE_MULTI_BLOCK_WRITE;
+    } else {
+        file->flags &= ~F_FILE_MULTI_BLOCK_WRITE;
+        sd_block_dev_write_stop(sd_dev);
+    }
+}
+
+
 /** @return True if this is a SdFile for a directory else false. */
 SA_INLINE uint8_t sd_file_is_dir(SdFile* file)
 {
@@ -254,6 +359,87 @@ SA_INLINE uint8_t sd_file_is_root(SdFile* file)
 }
 
 
+#ifdef SD_FILE_EXTENTS
+/** Forget the cluster runs known for a file. */
+SA_INLINE void sd_file_extents_clear(SdFile* file)
+{
+    file->extent_count = 0;
+    file->extent_end = 0;
+}
+
+
+// Record that @a cluster is cluster @a index of the file's chain. The map only
+// grows at its end, and stops growing once all of its runs are used.
+SA_FUNC void sd_file_extents_add(SdFile* file, uint32_t index, uint32_t cluster)
+{
+    if (index != file->extent_end) {
+        return;
+    }
+    if (file->extent_count) {
+        SdFileExtent* last = &file->extents[file->extent_count - 1];
+        if (last->cluster + (index - last->index) == cluster) {
+            file->extent_end++;
+            return;
+        }
+        if (file->extent_count == SD_FILE_EXTENTS) {
+            return;
+        }
+    }
+    file->extents[file->extent_count].index = index;
+    file->extents[file->extent_count].cluster = cluster;
+    file->extent_count++;
+    file->extent_end++;
+}
+
+
+// Look up cluster @a index of the file's chain without reading the FAT.
+// Returns false if the runs don't reach that far.
+SA_FUNC uint8_t sd_file_extents_find(SdFile* file, uint32_t index,
+                                     uint32_t* cluster)
+{
+    if (index >= file->extent_end) {
+        return false;
+    }
+    // runs from an earlier chain of this file are stale
+    if (file->extents[0].cluster != file->first_cluster) {
+        sd_file_extents_clear(file);
+        return false;
+    }
+    uint8_t i = file->extent_count - 1;
+    while (file->extents[i].index > index) {
+        i--;
+    }
+    *cluster = file->extents[i].cluster + (index - file->extents[i].index);
+    return true;
+}
+#endif
+
+
+// Replace @a cluster, cluster @a index of the file's chain, with the cluster
+// that follows it. The result is an EOC value at the end of the chain.
+SA_FUNC uint8_t sd_file_next_cluster(SdFile* file, uint32_t index,
+                                     uint32_t* cluster)
+{
+#ifdef SD_FILE_EXTENTS
+    if (sd_file_extents_find(file, index + 1, cluster)) {
+        return true;
+    }
+    sd_file_extents_add(file, index, *cluster);
+#else
+    (void) index;
+#endif
+    if (!sd_volume_fat_get(file->vol, *cluster, cluster)) {
+        return false;
+    }
+#ifdef SD_FILE_EXTENTS
+    if (!sd_volume_is_eoc(file->vol, *cluster)) {
+        sd_file_extents_add(file, index + 1, *cluster);
+    }
+#endif
+    return true;
+}
+
+
 /**
  * Open a volume's root directory.
  *
@@ -290,6 +476,9 @@ SA_FUNC uint8_t sd_file_open_root(SdFile* file, SdVolume* vol)
     // set to start of file
     file->cur_cluster = 0;
     file->cur_position = 0;
+#ifdef SD_FILE_EXTENTS
+    sd_file_extents_clear(file);
+#endif
 
     // root has no directory entry
     file->dir_block = 0;
@@ -304,7 +493,7 @@ SA_FUNC SdDir* sd_file_cache_dir_entry(SdFile* file, uint8_t action)
     if (!sd_volume_cache_raw_block(file->dir_block, action)) {
         return NULL;
     }
-    return cache_buffer.dir + file->dir_index;
+    return cache_buffer->dir + file->dir_index;
 }
 
 
@@ -360,6 +549,16 @@ SA_FUNC uint8_t sd_file_sync(SdFile* file)
     if (!sd_file_is_open(file)) {
         return false;
     }
+#ifdef SD_FILE_WRITE_BUFFER
+    if (!sd_file_write_buffer_flush(file)) {
+        return false;
+    }
+#endif
+
+    // end any multiple block write left open by sd_file_write()
+    if (!sd_block_dev_write_stop(sd_dev)) {
+        return false;
+    }
 
     if (file->flags & F_FILE_DIR_DIRTY) {
         SdDir* d = sd_file_cache_dir_entry(file, CACHE_FOR_WRITE);
@@ -384,7 +583,15 @@ SA_FUNC uint8_t sd_file_sync(SdFile* file)
         // clear directory dirty
         file->flags &= ~F_FILE_DIR_DIRTY;
     }
-    return sd_volume_cache_flush();
+#ifdef SD_FILE_COMMIT
+    file->commit_bytes = 0;
+#ifdef __AVR__
+    file->commit_ms = timer0_ms();
+#endif
+#endif
+    // update deferred mirror FATs and wait for any deferred write to be
+    // programmed
+    return sd_volume_sync(file->vol) && sd_block_dev_sync(sd_dev);
 }
 
 
@@ -399,7 +606,20 @@ SA_FUNC uint8_t sd_file_sync(SdFile* file)
 SA_FUNC uint8_t sd_file_seek_set(SdFile* file, uint32_t pos)
 {
     // error if file not open or seek past end of file
-    if (!sd_file_is_open(file) || pos > file->file_size) {
+    if (!sd_file_is_open(file)) {
+        return false;
+    }
+#ifdef SD_FILE_WRITE_BUFFER
+    if (!sd_file_write_buffer_flush(file)) {
+        return false;
+    }
+#endif
+    if (pos > file->file_size) {
+        return false;
+    }
+
+    // end any multiple block write left open by sd_file_write()
+    if (!sd_block_dev_write_stop(sd_dev)) {
         return false;
     }
 
@@ -417,15 +637,31 @@ SA_FUNC uint8_t sd_file_seek_set(SdFile* file, uint32_t pos)
     uint32_t n_cur = (file->cur_position - 1) >> (file->vol->cluster_size_shift + 9);
     uint32_t n_new = (pos - 1) >> (file->vol->cluster_size_shift + 9);
 
+#ifdef SD_FILE_EXTENTS
+    if (sd_file_extents_find(file, n_new, &file->cur_cluster)) {
+        file->cur_position = pos;
+        return true;
+    }
+#endif
+    uint32_t index; // position of cur_cluster in the chain
     if (n_new < n_cur || file->cur_position == 0) {
         // must follow chain from first cluster
         file->cur_cluster = file->first_cluster;
+        index = 0;
     } else {
         // advance from curPosition
-        n_new -= n_cur;
-    }
-    while (n_new--) {
-        if (!sd_volume_fat_get(file->vol, file->cur_cluster, &file->cur_cluster)) {
+        index = n_cur;
+    }
+#ifdef SD_FILE_EXTENTS
+    // or from the last cluster the extents know
+    if (file->extent_end > index + 1
+            && sd_file_extents_find(file, file->extent_end - 1,
+                                    &file->cur_cluster)) {
+        index = file->extent_end - 1;
+    }
+#endif
+    while (index < n_new) {
+        if (!sd_file_next_cluster(file, index++, &file->cur_cluster)) {
             return false;
         }
     }
@@ -434,6 +670,34 @@ SA_FUNC uint8_t sd_file_seek_set(SdFile* file, uint32_t pos)
 }
 
 
+#ifdef SD_FILE_EXTENTS
+/**
+ * Walk the whole cluster chain of a file, so that its extents are known before
+ * the first seek. Without this the extents are learned as the file is read,
+ * written and seeked.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_file_map_extents(SdFile* file)
+{
+    if (!sd_file_is_file(file)) {
+        return false;
+    }
+    uint32_t cluster = file->first_cluster;
+    for (uint32_t index = 0; cluster; index++) {
+        if (!sd_file_next_cluster(file, index, &cluster)) {
+            return false;
+        }
+        if (sd_volume_is_eoc(file->vol, cluster)) {
+            break;
+        }
+    }
+    return true;
+}
+#endif
+
+
 /**
  * Truncate a file to a specified length. The current file position will be
  * maintained if it is less than or equal to @a length otherwise it will be set
@@ -452,14 +716,19 @@ SA_FUNC uint8_t sd_file_truncate(SdFile* file, uint32_t length)
     if (!sd_file_is_file(file) || !(file->flags & O_WRITE)) {
         return false;
     }
+#ifdef SD_FILE_WRITE_BUFFER
+    if (!sd_file_write_buffer_flush(file)) {
+        return false;
+    }
+#endif
 
     // error if length is greater than current size
     if (length > file->file_size) {
         return false;
     }
 
-    // fileSize and length are zero - nothing to do
-    if (file->file_size == 0) {
+    // fileSize and length are zero and nothing is preallocated - nothing to do
+    if (file->file_size == 0 && file->first_cluster == 0) {
         return true;
     }
 
@@ -496,6 +765,9 @@ SA_FUNC uint8_t sd_file_truncate(SdFile* file, uint32_t length)
         }
     }
     file->file_size = length;
+#ifdef SD_FILE_EXTENTS
+    sd_file_extents_clear(file);
+#endif
 
     // need to update directory entry
     file->flags |= F_FILE_DIR_DIRTY;
@@ -509,12 +781,191 @@ SA_FUNC uint8_t sd_file_truncate(SdFile* file, uint32_t length)
 }
 
 
+/**
+ * Reserve a contiguous run of clusters for a file, so that writes up to
+ * @a length bytes never need to allocate clusters or touch the FAT.
+ *
+ * The run is found and linked into the file's cluster chain in a single pass
+ * over the FAT. The file size is not changed: writes fill the reserved
+ * clusters in order, and sd_file_truncate() with the final file size releases
+ * any that were not used.
+ *
+ * @param[in] length The number of bytes the file should be able to hold.
+ * @param[in] erase If true, the reserved blocks are erased with CMD32/33/38 so
+ *   that later writes land on erased flash. Cards without single block erase
+ *   skip the erase.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure. Reasons for failure include file is read
+ *   only, file is a directory, no contiguous run of free clusters is large
+ *   enough or an I/O error occurs.
+ */
+SA_FUNC uint8_t sd_file_preallocate(SdFile* file, uint32_t length,
+                                    uint8_t erase)
+{
+    // error if not a normal file or read-only
+    if (!sd_file_is_file(file) || !(file->flags & O_WRITE)) {
+        return false;
+    }
+
+    SdVolume* vol = file->vol;
+    // round up without overflow, as length may be within a cluster of 4 GiB
+    const uint8_t shift = vol->cluster_size_shift + 9;
+    const uint32_t want = (length >> shift)
+        + ((length & ((1UL << shift) - 1)) != 0);
+
+    // find the last cluster of the file and how many it has
+    uint32_t last_cluster = 0;
+    uint32_t have = 0;
+    if (file->first_cluster) {
+        uint32_t next = file->first_cluster;
+        do {
+            last_cluster = next;
+            have++;
+            if (!sd_volume_fat_get(vol, last_cluster, &next)) {
+                return false;
+            }
+        } while (!sd_volume_is_eoc(vol, next));
+    }
+    if (want <= have) {
+        return true;
+    }
+    const uint32_t count = want - have;
+
+    // allocate and link the run, connecting it to the end of the chain
+    uint32_t bgn_cluster = last_cluster;
+    if (!sd_volume_alloc_contiguous(vol, count, &bgn_cluster)) {
+        return false;
+    }
+    if (file->first_cluster == 0) {
+        file->first_cluster = bgn_cluster;
+        file->flags |= F_FILE_DIR_DIRTY;
+    }
+    if (!sd_file_sync(file)) {
+        return false;
+    }
+
+    return !erase || sd_volume_erase_clusters(vol, bgn_cluster, count);
+}
+
+
+#ifdef SD_FILE_CAPTURE
+/**
+ * Start a raw capture into an empty file. Define SD_FILE_CAPTURE for this.
+ *
+ * A contiguous run of clusters for @a length bytes is reserved with
+ * sd_file_preallocate() and a multiple block write is started at its first
+ * block, pre-erasing the whole run. sd_file_capture_write() then sends whole
+ * blocks straight to the card, bypassing the block cache and the FAT, until
+ * sd_file_capture_stop() is called.
+ *
+ * @param[in] length The maximum number of bytes that will be captured.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure. Reasons for failure include @a length is
+ *   zero, the file is not empty or is read only, no contiguous run of free
+ *   clusters is large enough or an I/O error occurs.
+ */
+SA_FUNC uint8_t sd_file_capture_start(SdFile* file, uint32_t length)
+{
+    if ((file->flags & F_FILE_CAPTURE) || length == 0) {
+        return false;
+    }
+    // the file must be empty so that all of its clusters are contiguous
+    if (file->file_size != 0 || file->first_cluster != 0) {
+        return false;
+    }
+    if (!sd_file_preallocate(file, length, false) || file->first_cluster == 0) {
+        return false;
+    }
+
+    const uint32_t first_block =
+        sd_volume_cluster_start_block(file->vol, file->first_cluster);
+    file->capture_blocks = (length + 511) >> 9;
+    file->cur_position = 0;
+    file->cur_cluster = 0;
+    file->flags |= F_FILE_CAPTURE;
+
+    // the run may still be cached from a removed file. Drop it, so a read
+    // can't see the old data and a flush can't overwrite the capture
+    sd_volume_cache_invalidate(first_block,
+                               first_block + file->capture_blocks - 1);
+
+    return sd_block_dev_write_start(sd_dev, first_block, file->capture_blocks);
+}
+
+
+/**
+ * Write the next 512 byte block of a raw capture.
+ *
+ * If another command ended the card's multiple block write since the last
+ * block, a new one is started for the rest of the reserved run.
+ *
+ * @param[in] src Pointer to the 512 bytes to write.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure. Reasons for failure include no capture is
+ *   in progress, the reserved space is full or an I/O error occurs.
+ */
+SA_FUNC uint8_t sd_file_capture_write(SdFile* file, const uint8_t* src)
+{
+    if (!(file->flags & F_FILE_CAPTURE)) {
+        return false;
+    }
+    const uint32_t index = file->cur_position >> 9;
+    if (index >= file->capture_blocks) {
+        return false;
+    }
+
+    const uint32_t block =
+        sd_volume_cluster_start_block(file->vol, file->first_cluster) + index;
+    if (!sd_block_dev_write_block_seq(sd_dev, block, src,
+                                      file->capture_blocks - index)) {
+        return false;
+    }
+
+    file->cur_position += 512;
+    file->file_size = file->cur_position;
+    return true;
+}
+
+
+/**
+ * End a raw capture. The multiple block write is stopped, the directory
+ * entry's file size is updated and the reserved clusters that were not used
+ * are released. The file position is left at the end of the captured data, so
+ * later writes append to it.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_file_capture_stop(SdFile* file)
+{
+    if (!(file->flags & F_FILE_CAPTURE)) {
+        return false;
+    }
+    file->flags &= ~F_FILE_CAPTURE;
+    file->flags |= F_FILE_DIR_DIRTY;
+
+    if (!sd_block_dev_write_stop(sd_dev)) {
+        return false;
+    }
+
+    // capture doesn't follow the cluster chain, so rewind for truncate()
+    file->cur_position = 0;
+    file->cur_cluster = 0;
+    return sd_file_truncate(file, file->file_size)
+        && sd_file_seek_set(file, file->file_size);
+}
+#endif
+
+
 // open a cached directory entry. Assumes vol_ is initialized
 SA_FUNC uint8_t sd_file_open_cached_entry(SdFile* file, uint8_t dir_index,
                                          uint8_t oflag)
 {
     // location of entry in cache
-    SdDir* p = cache_buffer.dir + dir_index;
+    SdDir* p = cache_buffer->dir + dir_index;
 
     // write or truncate is an error for a directory or read-only file
     if (p->attributes & (DIR_ATT_READ_ONLY | DIR_ATT_DIRECTORY)) {
@@ -524,7 +975,7 @@ SA_FUNC uint8_t sd_file_open_cached_entry(SdFile* file, uint8_t dir_index,
     }
     // remember location of directory entry on SD
     file->dir_index = dir_index;
-    file->dir_block = cache_block_number;
+    file->dir_block = cache_slot->block_number;
 
     // copy first cluster number for directory fields
     file->first_cluster = (uint32_t) p->first_cluster_high << 16;
@@ -549,6 +1000,9 @@ SA_FUNC uint8_t sd_file_open_cached_entry(SdFile* file, uint8_t dir_index,
     file->cur_cluster = 0;
     file->cur_position = 0;
     file->write_error = 0;
+#ifdef SD_FILE_EXTENTS
+    sd_file_extents_clear(file);
+#endif
 
     // truncate file to zero length if requested
     if (oflag & O_TRUNC) {
@@ -608,14 +1062,29 @@ SA_FUNC uint8_t sd_file_make83_name(const char* str, uint8_t* name)
  */
 SA_FUNC uint8_t sd_file_close(SdFile* file)
 {
+#ifdef SD_FILE_CAPTURE
+    // end any raw capture, releasing its unused clusters
+    if (sd_file_is_open(file) && (file->flags & F_FILE_CAPTURE)
+            && !sd_file_capture_stop(file)) {
+        return false;
+    }
+#endif
+    // end any multiple block read left open by sd_file_read()
+    if (sd_file_is_open(file) && !sd_block_dev_read_stop(sd_dev)) {
+        return false;
+    }
     if(!sd_file_sync(file)) {
         return false;
     }
     file->type = FAT_FILE_TYPE_CLOSED;
+#ifdef SD_FILE_WRITE_BUFFER
+    file->write_buf = NULL;
+#endif
     return true;
 }
 
 
+#ifdef __AVR__
 /**
  * Print a value as two digits to Serial.
  *
@@ -645,15 +1114,57 @@ SA_FUNC void sd_file_print_fat_time(uint16_t fat_time)
     usart_send(':');
     print_two_digits(FAT_SECOND(fat_time));
 }
+#endif//__AVR__
 
 
 SA_INLINE void sd_file_rewind(SdFile* file)
 {
+#ifdef SD_FILE_WRITE_BUFFER
+    // the buffered bytes belong at the old position
+    sd_file_write_buffer_flush(file);
+#endif
     file->cur_position = 0;
     file->cur_cluster = 0;
 }
 
 
+/**
+ * Find the device block that holds the current file position. At the start of
+ * a cluster, cur_cluster is first moved on to that cluster.
+ *
+ * @param[out] block The device block.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_file_cur_block(SdFile* file, uint32_t* block)
+{
+    if (file->type == FAT_FILE_TYPE_ROOT16) {
+        *block = file->vol->root_dir_start + (file->cur_position >> 9);
+        return true;
+    }
+    uint8_t block_of_cluster =
+        sd_volume_block_of_cluster(file->vol, file->cur_position);
+    if ((file->cur_position & 0x1FF) == 0 && block_of_cluster == 0) {
+        // start of new cluster
+        if (file->cur_position == 0) {
+            // use first cluster in file
+            file->cur_cluster = file->first_cluster;
+        } else {
+            // get next cluster from FAT
+            const uint32_t index = file->cur_position
+                >> (file->vol->cluster_size_shift + 9);
+            if (!sd_file_next_cluster(file, index - 1, &file->cur_cluster)) {
+                return false;
+            }
+        }
+    }
+    *block = sd_volume_cluster_start_block(file->vol, file->cur_cluster)
+        + block_of_cluster;
+    return true;
+}
+
+
 /**
  * Read data from a file starting at the current position.
  *
@@ -672,6 +1183,11 @@ SA_FUNC int16_t sd_file_read(SdFile* file, uint8_t* dst, uint16_t nbyte)
     if (!sd_file_is_open(file) || !(file->flags & O_READ)) {
         return -1;
     }
+#ifdef SD_FILE_WRITE_BUFFER
+    if (!sd_file_write_buffer_flush(file)) {
+        return -1;
+    }
+#endif
     if (file->cur_position == file->file_size) {
         return -1; // end of file
     }
@@ -687,26 +1203,8 @@ SA_FUNC int16_t sd_file_read(SdFile* file, uint8_t* dst, uint16_t nbyte)
         uint32_t block;  // raw device block number
         uint16_t offset = file->cur_position & 0x1FF;  // offset in block
 
-        if (file->type == FAT_FILE_TYPE_ROOT16) {
-            block = file->vol->root_dir_start + (file->cur_position >> 9);
-        } else {
-            uint8_t block_of_cluster =
-                sd_volume_block_of_cluster(file->vol, file->cur_position);
-            if (offset == 0 && block_of_cluster == 0) {
-                // start of new cluster
-                if (file->cur_position == 0) {
-                    // use first cluster in file
-                    file->cur_cluster = file->first_cluster;
-                } else {
-                    // get next cluster from FAT
-                    if (!sd_volume_fat_get(file->vol, file->cur_cluster,
-                                           &file->cur_cluster)) {
-                        return -1;
-                    }
-                }
-            }
-            block = sd_volume_cluster_start_block(file->vol, file->cur_cluster)
-                + block_of_cluster;
+        if (!sd_file_cur_block(file, &block)) {
+            return -1;
         }
         uint16_t n = to_read;
 
@@ -716,8 +1214,15 @@ SA_FUNC int16_t sd_file_read(SdFile* file, uint8_t* dst, uint16_t nbyte)
         }
 
         // no buffering needed if n == 512 or user requests no buffering
-        if ((sd_file_unbuffered_read(file) || n == 512) && block != cache_block_number) {
-            if (!sd_card_read_data(sd_card, block, offset, n, dst)) {
+        if ((sd_file_unbuffered_read(file) || n == 512)
+                && !sd_volume_cache_find(block)) {
+            if (n == 512) {
+                // whole blocks keep one multiple block read open, across
+                // contiguous blocks and clusters
+                if (!sd_block_dev_read_block_seq(sd_dev, block, dst)) {
+                    return -1;
+                }
+            } else if (!sd_block_dev_read(sd_dev, block, offset, n, dst)) {
                 return -1;
             }
             dst += n;
@@ -726,7 +1231,7 @@ SA_FUNC int16_t sd_file_read(SdFile* file, uint8_t* dst, uint16_t nbyte)
             if (!sd_volume_cache_raw_block(block, CACHE_FOR_READ)) {
                 return -1;
             }
-            uint8_t* src = cache_buffer.data + offset;
+            uint8_t* src = cache_buffer->data + offset;
             uint8_t* end = src + n;
             while (src != end) {
                 *dst++ = *src++;
@@ -773,7 +1278,7 @@ SA_FUNC SdDir* sd_file_read_dir_cache(SdFile* file)
     file->cur_position += 31;
 
     // return pointer to entry
-    return (cache_buffer.dir + i);
+    return (cache_buffer->dir + i);
 }
 
 
@@ -826,6 +1331,99 @@ SA_FUNC uint8_t sd_file_open_by_index(SdFile* file, SdFile* dir, uint16_t index,
 }
 
 
+#ifdef SD_DIR_CACHE
+/** Hash of an 8.3 name, for SdDirLookup and SdDirSummary */
+SA_INLINE uint16_t sd_file_name_hash(const uint8_t* name)
+{
+    uint16_t hash = 5381;
+    for (uint8_t i = 0; i < 11; i++) {
+        hash = (hash * 33) ^ name[i];
+    }
+    return hash;
+}
+
+
+// Set the bit of a name hash in a directory summary
+SA_INLINE void sd_file_dir_add_name(SdDirSummary* summary, uint16_t hash)
+{
+    const uint16_t bit = (hash ^ (hash >> 8)) & (SD_DIR_NAME_BITS - 1);
+    summary->names[bit >> 3] |= 1 << (bit & 7);
+}
+
+
+// @return True if the bit of a name hash is set in a directory summary
+SA_INLINE uint8_t sd_file_dir_may_have(SdDirSummary* summary, uint16_t hash)
+{
+    const uint16_t bit = (hash ^ (hash >> 8)) & (SD_DIR_NAME_BITS - 1);
+    return summary->names[bit >> 3] & (1 << (bit & 7));
+}
+
+
+// Remember that the entry for a name in @a dir is at @a index of @a block
+SA_FUNC void sd_file_dir_remember(SdFile* dir, uint16_t hash, uint32_t block,
+                                  uint8_t index)
+{
+    SdVolume* vol = dir->vol;
+    SdDirLookup* lookup = NULL;
+    for (uint8_t i = 0; i < SD_DIR_CACHE; i++) {
+        SdDirLookup* l = &vol->dir_lookup[i];
+        if (l->dir_block && l->dir_cluster == dir->first_cluster
+                && l->name_hash == hash) {
+            lookup = l;
+            break;
+        }
+    }
+    if (!lookup) {
+        lookup = &vol->dir_lookup[vol->dir_lookup_next];
+        vol->dir_lookup_next = (vol->dir_lookup_next + 1) % SD_DIR_CACHE;
+    }
+    lookup->dir_cluster = dir->first_cluster;
+    lookup->name_hash = hash;
+    lookup->dir_block = block;
+    lookup->dir_index = index;
+}
+
+
+// Cache the block where @a name was last found in @a dir. Returns the index
+// of its entry in cache_buffer, or -1 if it isn't remembered there any more.
+SA_FUNC int8_t sd_file_dir_recall(SdFile* dir, const uint8_t* name,
+                                  uint16_t hash)
+{
+    SdVolume* vol = dir->vol;
+    for (uint8_t i = 0; i < SD_DIR_CACHE; i++) {
+        SdDirLookup* l = &vol->dir_lookup[i];
+        if (!l->dir_block || l->dir_cluster != dir->first_cluster
+                || l->name_hash != hash) {
+            continue;
+        }
+        SdCache* cache = sd_volume_cache_raw_block(l->dir_block, CACHE_FOR_READ);
+        if (cache && !memcmp(cache->dir[l->dir_index].name, name, 11)) {
+            return l->dir_index;
+        }
+        l->dir_block = 0; // the entry was removed or renamed
+    }
+    return -1;
+}
+
+
+/**
+ * Forget what @a vol remembers about the directory whose first cluster is
+ * @a dir_cluster, after it is removed.
+ */
+SA_FUNC void sd_file_dir_forget(SdVolume* vol, uint32_t dir_cluster)
+{
+    for (uint8_t i = 0; i < SD_DIR_CACHE; i++) {
+        if (vol->dir_lookup[i].dir_cluster == dir_cluster) {
+            vol->dir_lookup[i].dir_block = 0;
+        }
+    }
+    if (vol->dir_summary.dir_cluster == dir_cluster) {
+        vol->dir_summary.valid = false;
+    }
+}
+#endif
+
+
 /**
  * Open a file or directory by name.
  *
@@ -850,7 +1448,8 @@ SA_FUNC uint8_t sd_file_open_by_index(SdFile* file, SdFile* dir, uint16_t index,
  * O_SYNC   - Call sync() after each write. This flag should not be used with
  *            write(uint8_t), write_P(PGM_P), writeln_P(PGM_P), or the Arduino
  *            Print class. These functions do character at a time writes so
- *            sync() will be called after each byte.
+ *            sync() will be called after each byte. See sd_file_set_commit()
+ *            for syncing less often.
  * O_TRUNC  - If the file exists and is a regular file, and the file is
  *            successfully opened and is not read only, its length shall be
  *            truncated to 0.
@@ -881,38 +1480,102 @@ SA_FUNC uint8_t sd_file_open(SdFile* file, SdFile* dir, const char* file_name,
     file->vol = dir->vol;
     sd_file_rewind(dir);
 
+#ifdef SD_DIR_CACHE
+    SdDirSummary* summary = &dir->vol->dir_summary;
+    const uint16_t hash = sd_file_name_hash(dname);
+    uint8_t summarize = false; // build the summary while scanning
+    uint32_t empty_position = 0;
+
+    // look where the name was found last time
+    const int8_t found = sd_file_dir_recall(dir, dname, hash);
+    if (found >= 0) {
+        if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+            return false;
+        }
+        return sd_file_open_cached_entry(file, found, oflag);
+    }
+    if (summary->valid && summary->dir_cluster == dir->first_cluster
+            && !sd_file_dir_may_have(summary, hash)) {
+        // the name isn't in the directory, only a free entry is needed
+        if ((oflag & (O_CREAT | O_WRITE)) != (O_CREAT | O_WRITE)) {
+            return false;
+        }
+        if (summary->free_position <= dir->file_size
+                && !sd_file_seek_set(dir, summary->free_position)) {
+            return false;
+        }
+    } else {
+        summarize = true;
+        summary->valid = false;
+        summary->dir_cluster = dir->first_cluster;
+        memset(summary->names, 0, sizeof(summary->names));
+    }
+#endif
+
     // bool for empty entry found
     uint8_t empty_found = false;
 
-    // search for file
-    while (dir->cur_position < dir->file_size) {
-        uint8_t index = 0xF & (dir->cur_position >> 5);
-        p = sd_file_read_dir_cache(dir);
-        if (p == NULL) {
+    // bool for end of used entries found
+    uint8_t end_found = false;
+
+    // search for file, a block of entries at a time
+    while (!end_found && dir->cur_position < dir->file_size) {
+        uint32_t block;
+        if (!sd_file_is_dir(dir) || !sd_file_cur_block(dir, &block)) {
+            return false;
+        }
+        SdCache* cache = sd_volume_cache_raw_block(block, CACHE_FOR_READ);
+        if (!cache) {
             return false;
         }
+        uint8_t index = 0xF & (dir->cur_position >> 5);
+        for (; index < 16 && dir->cur_position < dir->file_size; index++) {
+            p = cache->dir + index;
+            dir->cur_position += sizeof(SdDir);
+
+            if (p->name[0] == DIR_NAME_FREE || p->name[0] == DIR_NAME_DELETED) {
+                // remember first empty slot
+                if (!empty_found) {
+                    empty_found = true;
+                    file->dir_index = index;
+                    file->dir_block = block;
+#ifdef SD_DIR_CACHE
+                    empty_position = dir->cur_position - sizeof(SdDir);
+#endif
+                }
+                // done if no entries follow
+                if (p->name[0] == DIR_NAME_FREE) {
+                    end_found = true;
+                    break;
+                }
+            } else if (!memcmp(dname, p->name, 11)) {
+                // don't open existing file if O_CREAT and O_EXCL
+                if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+                    return false;
+                }
 
-        if (p->name[0] == DIR_NAME_FREE || p->name[0] == DIR_NAME_DELETED) {
-            // remember first empty slot
-            if (!empty_found) {
-                empty_found = true;
-                file->dir_index = index;
-                file->dir_block = cache_block_number;
-            }
-            // done if no entries follow
-            if (p->name[0] == DIR_NAME_FREE) {
-                break;
-            }
-        } else if (!memcmp(dname, p->name, 11)) {
-            // don't open existing file if O_CREAT and O_EXCL
-            if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
-                return false;
+                // open found file
+#ifdef SD_DIR_CACHE
+                sd_file_dir_remember(dir, hash, block, index);
+#endif
+                return sd_file_open_cached_entry(file, index, oflag);
+#ifdef SD_DIR_CACHE
+            } else if (summarize) {
+                sd_file_dir_add_name(summary, sd_file_name_hash(p->name));
+#endif
             }
-
-            // open found file
-            return sd_file_open_cached_entry(file, 0xF & index, oflag);
         }
     }
+#ifdef SD_DIR_CACHE
+    if (!empty_found) {
+        empty_position = dir->file_size; // a cluster will be added
+    }
+    if (summarize) {
+        // the whole directory was scanned
+        summary->valid = true;
+        summary->free_position = empty_position;
+    }
+#endif
     // only create file if O_CREAT and O_WRITE
     if ((oflag & (O_CREAT | O_WRITE)) != (O_CREAT | O_WRITE)) {
         return false;
@@ -936,7 +1599,7 @@ SA_FUNC uint8_t sd_file_open(SdFile* file, SdFile* dir, const char* file_name,
 
         // use first entry in cluster
         file->dir_index = 0;
-        p = cache_buffer.dir;
+        p = cache_buffer->dir;
     }
     // initialize as empty file
     memset(p, 0, sizeof(SdDir));
@@ -965,11 +1628,20 @@ SA_FUNC uint8_t sd_file_open(SdFile* file, SdFile* dir, const char* file_name,
         return false;
     }
 
+#ifdef SD_DIR_CACHE
+    if (summary->valid && summary->dir_cluster == dir->first_cluster) {
+        sd_file_dir_add_name(summary, hash);
+        summary->free_position = empty_position + sizeof(SdDir);
+    }
+    sd_file_dir_remember(dir, hash, cache_slot->block_number, file->dir_index);
+#endif
+
     // open entry in cache
     return sd_file_open_cached_entry(file, file->dir_index, oflag);
 }
 
 
+#ifdef __AVR__
 /**
  * Print the name field of a directory entry in 8.3 format to Serial.
  *
@@ -1084,6 +1756,7 @@ SA_FUNC void sd_file_ls(SdFile* file, uint8_t flags, uint8_t indent)
         }
     }
 }
+#endif//__AVR__
 
 
 /**
@@ -1195,7 +1868,7 @@ SA_FUNC uint8_t sd_file_make_dir(SdFile* file, SdFile* dir, const char* dir_name
     }
 
     // copy '.' to block
-    memcpy(&cache_buffer.dir[0], &d, sizeof(d));
+    memcpy(&cache_buffer->dir[0], &d, sizeof(d));
 
     // make entry for '..'
     d.name[1] = '.';
@@ -1207,7 +1880,7 @@ SA_FUNC uint8_t sd_file_make_dir(SdFile* file, SdFile* dir, const char* dir_name
         d.first_cluster_high = dir->first_cluster >> 16;
     }
 
-    memcpy(&cache_buffer.dir[1], &d, sizeof(d)); // copy '..' to block
+    memcpy(&cache_buffer->dir[1], &d, sizeof(d)); // copy '..' to block
     file->cur_position = 2 * sizeof(d);          // set position after '..'
     return sd_volume_cache_flush();              // write first block
 }
@@ -1360,6 +2033,9 @@ SA_FUNC uint8_t sd_file_rm_dir(SdFile* file)
     // convert empty directory to normal file for remove
     file->type = FAT_FILE_TYPE_NORMAL;
     file->flags |= O_WRITE;
+#ifdef SD_DIR_CACHE
+    sd_file_dir_forget(file->vol, file->first_cluster);
+#endif
     return sd_file_remove(file);
 }
 
@@ -1504,6 +2180,58 @@ SA_FUNC uint8_t sd_file_timestamp(SdFile* file, uint8_t flags, uint16_t year,
 }
 
 
+#ifdef SD_FILE_COMMIT
+/**
+ * Choose when writes to an open file are synced, to bound what a power
+ * failure can lose without syncing, and so rewriting the directory entry, on
+ * every write as O_SYNC does. O_SYNC still syncs every write.
+ *
+ * The policy is checked by sd_file_write(). Bytes held in a write buffer, see
+ * sd_file_set_write_buffer(), are counted once they are written out, except
+ * with SD_COMMIT_MS, which also syncs them. An idle file isn't synced.
+ *
+ * @param[in] policy One of SD_COMMIT_EXPLICIT, SD_COMMIT_BYTES, SD_COMMIT_MS
+ *   or SD_COMMIT_BLOCK.
+ * @param[in] every The number of bytes for SD_COMMIT_BYTES, or milliseconds,
+ *   below 65536, for SD_COMMIT_MS.
+ */
+SA_INLINE void sd_file_set_commit(SdFile* file, uint8_t policy,
+                                  uint32_t every)
+{
+    file->commit_policy = policy;
+    file->commit_every = every;
+    file->commit_bytes = 0;
+#ifdef __AVR__
+    file->commit_ms = timer0_ms();
+#endif
+}
+#endif
+
+
+// Should a write sync the file now? @a block_end if it completed a block.
+SA_INLINE bool sd_file_commit_due(SdFile* file, bool block_end)
+{
+    if (file->flags & O_SYNC) {
+        return true;
+    }
+#ifdef SD_FILE_COMMIT
+    switch (file->commit_policy) {
+    case SD_COMMIT_BYTES:
+        return file->commit_bytes >= file->commit_every;
+#ifdef __AVR__
+    case SD_COMMIT_MS:
+        return (uint16_t) (timer0_ms() - file->commit_ms) >= file->commit_every;
+#endif
+    case SD_COMMIT_BLOCK:
+        return block_end;
+    }
+#else
+    (void) block_end;
+#endif
+    return false;
+}
+
+
 /**
  * Write data to an open file.
  *
@@ -1523,11 +2251,19 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
 {
     // number of bytes left to write - must be before goto statements
     uint16_t n_to_write = nbyte;
+    uint32_t start_position;
 
-    // error if not a normal file or is read-only
-    if (!sd_file_is_file(file) || !(file->flags & O_WRITE)) {
+    // error if not a normal file, is read-only or is capturing
+    if (!sd_file_is_file(file) || !(file->flags & O_WRITE)
+            || (file->flags & F_FILE_CAPTURE)) {
         goto write_error_return;
     }
+#ifdef SD_FILE_WRITE_BUFFER
+    // keep buffered bytes ahead of these
+    if (!sd_file_write_buffer_flush(file)) {
+        goto write_error_return;
+    }
+#endif
 
     // seek to end of file if append flag
     if ((file->flags & O_APPEND) && file->cur_position != file->file_size) {
@@ -1535,6 +2271,7 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
             goto write_error_return;
         }
     }
+    start_position = file->cur_position;
 
     while (n_to_write > 0) {
         uint8_t block_of_cluster =
@@ -1552,8 +2289,10 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
                     file->cur_cluster = file->first_cluster;
                 }
             } else {
-                uint32_t next;
-                if (!sd_volume_fat_get(file->vol, file->cur_cluster, &next)) {
+                const uint32_t index = file->cur_position
+                    >> (file->vol->cluster_size_shift + 9);
+                uint32_t next = file->cur_cluster;
+                if (!sd_file_next_cluster(file, index - 1, &next)) {
                     return false;
                 }
                 if (sd_volume_is_eoc(file->vol, next)) {
@@ -1561,6 +2300,9 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
                     if (!sd_file_add_cluster(file)) {
                         goto write_error_return;
                     }
+#ifdef SD_FILE_EXTENTS
+                    sd_file_extents_add(file, index, file->cur_cluster);
+#endif
                 } else {
                     file->cur_cluster = next;
                 }
@@ -1582,21 +2324,25 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
         if (n == 512) {
             // full block - don't need to use cache
             // invalidate cache if block is in cache
-            if (cache_block_number == block) {
-                cache_block_number = 0xFFFFFFFF;
-            }
-            if (!sd_card_write_block(sd_card, block, src)) {
+            sd_volume_cache_invalidate(block, block);
+            if (file->flags & F_FILE_MULTI_BLOCK_WRITE) {
+                // pre-erase the rest of the cluster, which is known to be ours
+                uint8_t erase_count =
+                    file->vol->blocks_per_cluster - block_of_cluster;
+                if (!sd_block_dev_write_block_seq(sd_dev, block, src,
+                                                  erase_count)) {
+                    goto write_error_return;
+                }
+            } else if (!sd_block_dev_write_block(sd_dev, block, src)) {
                 goto write_error_return;
             }
             src += 512;
         } else {
             if (block_offset == 0 && file->cur_position >= file->file_size) {
                 // start of new block don't need to read into cache
-                if (!sd_volume_cache_flush()) {
+                if (!sd_volume_cache_claim_block(block, CACHE_FOR_WRITE)) {
                     goto write_error_return;
                 }
-                cache_block_number = block;
-                sd_volume_cache_set_dirty();
             } else {
                 // rewrite part of block
                 if (!sd_volume_cache_raw_block(block, CACHE_FOR_WRITE)) {
@@ -1604,7 +2350,7 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
                 }
             }
 
-            uint8_t* dst = cache_buffer.data + block_offset;
+            uint8_t* dst = cache_buffer->data + block_offset;
             uint8_t* end = dst + n;
             while (dst != end) {
                 *dst++ = *src++;
@@ -1622,7 +2368,11 @@ SA_FUNC size_t sd_file_write(SdFile* file, const uint8_t* src, uint16_t nbyte)
         file->flags |= F_FILE_DIR_DIRTY;
     }
 
-    if (file->flags & O_SYNC) {
+#ifdef SD_FILE_COMMIT
+    file->commit_bytes += nbyte;
+#endif
+    if (sd_file_commit_due(file,
+                           (start_position >> 9) != (file->cur_position >> 9))) {
         if (!sd_file_sync(file)) {
             goto write_error_return;
         }
@@ -1636,6 +2386,148 @@ write_error_return:
 }
 
 
+#ifdef SD_FILE_WRITE_BUFFER
+// Write the first @a n buffered bytes to the file
+SA_FUNC uint8_t sd_file_write_buffer_out(SdFile* file, uint16_t n)
+{
+    if (n == 0) {
+        return true;
+    }
+    const uint16_t len = file->write_buf_len;
+    const uint32_t position = file->cur_position;
+    const uint32_t size = file->file_size;
+
+    // go back to where the buffered bytes are written
+    file->cur_position -= len;
+    file->file_size -= file->write_buf_grow;
+    file->write_buf_len = 0; // so sd_file_write() doesn't flush them again
+    file->write_buf_grow = 0;
+    if (sd_file_write(file, file->write_buf, n) != n) {
+        return false; // the rest of the buffer is lost
+    }
+
+    // count the bytes still buffered again
+    memmove(file->write_buf, file->write_buf + n, len - n);
+    file->write_buf_len = len - n;
+    file->write_buf_grow = size - file->file_size;
+    file->cur_position = position;
+    file->file_size = size;
+    return true;
+}
+
+
+/**
+ * Write out a file's buffered bytes. sd_file_sync(), sd_file_close(),
+ * sd_file_read(), sd_file_seek_set(), sd_file_truncate() and sd_file_write()
+ * do this first.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_file_write_buffer_flush(SdFile* file)
+{
+    return sd_file_write_buffer_out(file, file->write_buf_len);
+}
+
+
+/**
+ * Give an open file a buffer for sd_file_write_buffered(), and the calls
+ * built on it, sd_file_send(), sd_file_print() and sd_file_write_P(). Small
+ * writes are gathered in it, and it's written out when full, up to the last
+ * block boundary it reaches. With a 512 byte buffer each block of the file
+ * is then written whole, without first being read into the block cache.
+ *
+ * cur_position and file_size count the buffered bytes, so they can be used as
+ * usual, e.g. to seek to the end of the file. The directory entry and the
+ * device only do once the buffer is flushed. Closing the file flushes the
+ * buffer and forgets it.
+ *
+ * @param[in] buf The buffer, which must stay valid while the file is open,
+ *   or NULL to stop buffering.
+ * @param[in] size The size of @a buf. A multiple of 512 is best.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_file_set_write_buffer(SdFile* file, uint8_t* buf,
+                                         uint16_t size)
+{
+    if (!sd_file_write_buffer_flush(file)) {
+        return false;
+    }
+    file->write_buf = size ? buf : NULL;
+    file->write_buf_size = size;
+    return true;
+}
+#endif
+
+
+/**
+ * Write data to an open file through its write buffer, if it has one. See
+ * sd_file_set_write_buffer(). Otherwise this is sd_file_write().
+ *
+ * @return For success, @a nbyte. If an error occurs, zero, and
+ *   SdFile.write_error is set. Errors from writing the buffer out may only be
+ *   reported by a later call.
+ */
+SA_FUNC size_t sd_file_write_buffered(SdFile* file, const uint8_t* src,
+                                      uint16_t nbyte)
+{
+#ifdef SD_FILE_WRITE_BUFFER
+    if (file->write_buf) {
+        if (!sd_file_is_file(file) || !(file->flags & O_WRITE)) {
+            file->write_error = 1;
+            return 0;
+        }
+        // buffered bytes must end at cur_position
+        if ((file->flags & O_APPEND) && file->cur_position != file->file_size
+                && !sd_file_seek_set(file, file->file_size)) {
+            file->write_error = 1;
+            return 0;
+        }
+        for (uint16_t left = nbyte; left; ) {
+            uint16_t n = file->write_buf_size - file->write_buf_len;
+            if (n > left) {
+                n = left;
+            }
+            memcpy(file->write_buf + file->write_buf_len, src, n);
+            file->write_buf_len += n;
+            file->cur_position += n;
+            if (file->cur_position > file->file_size) {
+                file->write_buf_grow += file->cur_position - file->file_size;
+                file->file_size = file->cur_position;
+            }
+            src += n;
+            left -= n;
+
+            if (file->write_buf_len == file->write_buf_size) {
+                // write out up to the last block boundary in the buffer
+                uint32_t pos = file->cur_position - file->write_buf_len;
+                uint16_t out = file->write_buf_len;
+                uint16_t to_boundary = 512 - (pos & 0x1FF);
+                if (out >= to_boundary) {
+                    out = to_boundary + ((out - to_boundary) & ~0x1FF);
+                }
+                if (!sd_file_write_buffer_out(file, out)) {
+                    return 0;
+                }
+            }
+        }
+#if defined(SD_FILE_COMMIT) && defined(__AVR__)
+        // a time limit covers the bytes still in the buffer too
+        if (file->commit_policy == SD_COMMIT_MS
+                && sd_file_commit_due(file, false) && !sd_file_sync(file)) {
+            file->write_error = 1;
+            return 0;
+        }
+#endif
+        return nbyte;
+    }
+#endif
+    return sd_file_write(file, src, nbyte);
+}
+
+
 /**
  * Write a byte to a file. Required by the Arduino Print class.
  *
@@ -1643,7 +2535,7 @@ write_error_return:
  */
 SA_INLINE size_t sd_file_send(SdFile* file, uint8_t b)
 {
-    return sd_file_write(file, &b, 1);
+    return sd_file_write_buffered(file, &b, 1);
 }
 
 
@@ -1662,7 +2554,7 @@ SA_INLINE size_t sd_file_crlf(SdFile* file)
  */
 SA_INLINE size_t sd_file_print(SdFile* file, const char* str)
 {
-    return sd_file_write(file, (const uint8_t*) str, strlen(str));
+    return sd_file_write_buffered(file, (const uint8_t*) str, strlen(str));
 }
 
 
@@ -1702,4 +2594,45 @@ SA_INLINE void sd_file_writeln_P(SdFile* file, PGM_P str)
     sd_file_write_P(file, str);
     sd_file_crlf(file);
 }
+
+
+#ifdef __AVR__
+SA_FUNC int sd_file_stream_send(char c, FILE* stream)
+{
+    SdFile* file = (SdFile*) fdev_get_udata(stream);
+    return sd_file_send(file, (uint8_t) c) ? 0 : EOF;
+}
+
+
+/**
+ * Open a stdio stream that writes to an open file, for fprintf() and the
+ * like. Give the file a buffer with sd_file_set_write_buffer() first, or
+ * each character is a separate sd_file_write().
+ *
+ * @note As with usart_setup_stdout(), fdevopen() makes the first stream it
+ *   opens for writing stdout and stderr.
+ *
+ * @return The stream, to be closed with fclose() before the file is, or
+ *   NULL if it couldn't be allocated.
+ */
+SA_FUNC FILE* sd_file_fdevopen(SdFile* file)
+{
+    FILE* stream = fdevopen(sd_file_stream_send, NULL);
+    if (stream) {
+        fdev_set_udata(stream, file);
+    }
+    return stream;
+}
+
+
+/**
+ * Set up a caller's stream to write to an open file, like sd_file_fdevopen()
+ * but without allocating it.
+ */
+SA_INLINE void sd_file_stream_init(FILE* stream, SdFile* file)
+{
+    fdev_setup_stream(stream, sd_file_stream_send, NULL, _FDEV_SETUP_WRITE);
+    fdev_set_udata(stream, file);
+}
+#endif
 #endif//SD_FILE_H
@@ -0,0 +1,171 @@
+#ifndef SD_IMAGE_DISK_H
+#define SD_IMAGE_DISK_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * A SdBlockDev backend over a disk image file, for host builds. An image of an
+ * SD card (e.g. made with `dd`) can be mounted with sd_volume_init() and used
+ * through sd_file.h to benchmark and tune the FAT layer on a workstation.
+ *
+ * Multiple block sequences are kept as runs of sequential stdio reads or
+ * writes without a seek between blocks.
+ */
+#ifndef __AVR__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "sangster/api.h"
+#include "sangster/sd/sd_block_dev.h"
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+typedef struct sd_image_disk SdImageDisk;
+struct sd_image_disk
+{
+    FILE* file;
+    uint32_t block_count; // size of the image in blocks
+};
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+// position the image at a byte address, and check the block is in the image
+SA_FUNC uint8_t sd_image_disk_seek(SdImageDisk* disk, uint32_t block,
+                                   uint16_t offset)
+{
+    if (block >= disk->block_count) {
+        return false;
+    }
+    return fseek(disk->file, ((long) block << 9) + offset, SEEK_SET) == 0;
+}
+
+
+// SdBlockDev operations for a disk image. See sd_image_disk_open()
+SA_FUNC uint8_t sd_image_disk_read(void* ctx, uint32_t block, uint16_t offset,
+                                   uint16_t count, uint8_t* dst)
+{
+    SdImageDisk* disk = (SdImageDisk*) ctx;
+    if (offset + count > 512 || !sd_image_disk_seek(disk, block, offset)) {
+        return false;
+    }
+    return fread(dst, 1, count, disk->file) == count;
+}
+
+
+SA_FUNC uint8_t sd_image_disk_write(void* ctx, uint32_t block,
+                                    const uint8_t* src)
+{
+    SdImageDisk* disk = (SdImageDisk*) ctx;
+    if (!sd_image_disk_seek(disk, block, 0)) {
+        return false;
+    }
+    return fwrite(src, 1, 512, disk->file) == 512;
+}
+
+
+SA_FUNC uint8_t sd_image_disk_read_start(void* ctx, uint32_t block)
+{
+    return sd_image_disk_seek((SdImageDisk*) ctx, block, 0);
+}
+
+
+SA_FUNC uint8_t sd_image_disk_write_start(void* ctx, uint32_t block,
+                                          __attribute__((unused))
+                                          uint32_t erase_count)
+{
+    return sd_image_disk_seek((SdImageDisk*) ctx, block, 0);
+}
+
+
+SA_FUNC uint8_t sd_image_disk_read_data(void* ctx, uint8_t* dst)
+{
+    return fread(dst, 1, 512, ((SdImageDisk*) ctx)->file) == 512;
+}
+
+
+SA_FUNC uint8_t sd_image_disk_write_data(void* ctx, const uint8_t* src)
+{
+    return fwrite(src, 1, 512, ((SdImageDisk*) ctx)->file) == 512;
+}
+
+
+SA_FUNC uint8_t sd_image_disk_stop(__attribute__((unused)) void* ctx)
+{
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_image_disk_sync(void* ctx)
+{
+    return fflush(((SdImageDisk*) ctx)->file) == 0;
+}
+
+
+/**
+ * Open a disk image file as a block device.
+ *
+ * @param[out] dev The block device.
+ * @param[out] disk The image disk state, which must outlive @a dev.
+ * @param[in] path Path of the image file, which is opened for reading and
+ *   writing.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned if the image could not be opened.
+ */
+SA_FUNC uint8_t sd_image_disk_open(SdBlockDev* dev, SdImageDisk* disk,
+                                   const char* path)
+{
+    disk->file = fopen(path, "r+b");
+    if (!disk->file) {
+        return false;
+    }
+    if (fseek(disk->file, 0, SEEK_END) != 0) {
+        fclose(disk->file);
+        return false;
+    }
+    disk->block_count = ftell(disk->file) >> 9;
+
+    sd_block_dev_init(dev);
+    dev->ctx = disk;
+    dev->read = sd_image_disk_read;
+    dev->write = sd_image_disk_write;
+    dev->read_start = sd_image_disk_read_start;
+    dev->read_data = sd_image_disk_read_data;
+    dev->read_stop = sd_image_disk_stop;
+    dev->write_start = sd_image_disk_write_start;
+    dev->write_data = sd_image_disk_write_data;
+    dev->write_stop = sd_image_disk_stop;
+    dev->sync = sd_image_disk_sync;
+    return true;
+}
+
+
+/** Close a disk image opened with sd_image_disk_open(). */
+SA_FUNC uint8_t sd_image_disk_close(SdBlockDev* dev, SdImageDisk* disk)
+{
+    const uint8_t ok = sd_block_dev_sync(dev);
+    return fclose(disk->file) == 0 && ok;
+}
+#endif//__AVR__
+#endif//SD_IMAGE_DISK_H
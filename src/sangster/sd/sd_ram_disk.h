@@ -0,0 +1,107 @@
+#ifndef SD_RAM_DISK_H
+#define SD_RAM_DISK_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * A SdBlockDev backend that keeps its blocks in a RAM buffer. On the AVR this
+ * is only useful for a tiny volume, but on a host it lets the FAT layer be
+ * exercised and timed without a card.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "sangster/api.h"
+#include "sangster/sd/sd_block_dev.h"
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+typedef struct sd_ram_disk SdRamDisk;
+struct sd_ram_disk
+{
+    uint8_t* data;        // block_count * 512 bytes
+    uint32_t block_count; // size of the disk in blocks
+};
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+// SdBlockDev operations for a RAM disk. See sd_ram_disk_init()
+SA_FUNC uint8_t sd_ram_disk_read(void* ctx, uint32_t block, uint16_t offset,
+                                 uint16_t count, uint8_t* dst)
+{
+    SdRamDisk* disk = (SdRamDisk*) ctx;
+    if (block >= disk->block_count || offset + count > 512) {
+        return false;
+    }
+    memcpy(dst, disk->data + (block << 9) + offset, count);
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_ram_disk_write(void* ctx, uint32_t block, const uint8_t* src)
+{
+    SdRamDisk* disk = (SdRamDisk*) ctx;
+    if (block >= disk->block_count) {
+        return false;
+    }
+    memcpy(disk->data + (block << 9), src, 512);
+    return true;
+}
+
+
+SA_FUNC uint8_t sd_ram_disk_erase(void* ctx, uint32_t first_block,
+                                  uint32_t last_block)
+{
+    SdRamDisk* disk = (SdRamDisk*) ctx;
+    if (first_block > last_block || last_block >= disk->block_count) {
+        return false;
+    }
+    memset(disk->data + (first_block << 9), 0,
+           (last_block - first_block + 1) << 9);
+    return true;
+}
+
+
+/**
+ * Set up a block device over a RAM buffer. The buffer may already hold a FAT
+ * image; it is used as is.
+ *
+ * @param[out] dev The block device.
+ * @param[out] disk The RAM disk state, which must outlive @a dev.
+ * @param[in] data Buffer of @a block_count * 512 bytes.
+ * @param[in] block_count Size of the disk in blocks.
+ */
+SA_FUNC void sd_ram_disk_init(SdBlockDev* dev, SdRamDisk* disk, uint8_t* data,
+                              uint32_t block_count)
+{
+    disk->data = data;
+    disk->block_count = block_count;
+
+    sd_block_dev_init(dev);
+    dev->ctx = disk;
+    dev->read = sd_ram_disk_read;
+    dev->write = sd_ram_disk_write;
+    dev->erase = sd_ram_disk_erase;
+}
+#endif//SD_RAM_DISK_H
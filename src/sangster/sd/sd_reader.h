@@ -0,0 +1,200 @@
+#ifndef SD_READER_H
+#define SD_READER_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * A double buffered reader for playing a file back from start to end. The
+ * reader owns two 512 byte buffers. Each sd_reader_next() hands one buffer to
+ * the caller and starts filling the other with the next block of the file.
+ * With an SD card, the fill runs in the background through sd_async.h, so it
+ * overlaps the caller's work on the first buffer:
+ *
+ *     SdReader reader;
+ *     const uint8_t* data;
+ *     int16_t n;
+ *
+ *     sd_reader_open(&reader, &file, &sd.card);
+ *     while ((n = sd_reader_next(&reader, &data)) > 0) {
+ *         play(data, n); // the card fills the other buffer meanwhile
+ *     }
+ *     sd_reader_close(&reader);
+ *
+ * Consecutive blocks are read in one multiple block sequence, which stays open
+ * between calls. The SPI interrupt must be forwarded to
+ * sd_async_interrupt_callback().
+ */
+
+#include <string.h>
+#include "sangster/api.h"
+#include "sangster/sd/sd_async.h"
+#include "sangster/sd/sd_card.h"
+#include "sangster/sd/sd_file.h"
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+typedef struct sd_reader SdReader;
+struct sd_reader
+{
+    SdFile* file;
+    SdCard* card;        // card for background reads, NULL for other devices
+    uint8_t buf[2][512];
+    uint16_t len[2];     // bytes of the file in each buffer
+    uint8_t ready;       // buffer the next sd_reader_next() returns
+    uint8_t in_flight;   // a background read is filling buf[!ready]
+};
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+// Start reading device block @a block into buf[i]
+SA_FUNC uint8_t sd_reader_read(SdReader* reader, uint8_t i, uint32_t block)
+{
+    // the cache may hold a newer copy of the block
+    SdCacheSlot* slot = sd_volume_cache_find(block);
+    if (slot) {
+        memcpy(reader->buf[i], slot->buffer.data, 512);
+        return true;
+    }
+    if (!reader->card) {
+        return sd_block_dev_read_block_seq(sd_dev, block, reader->buf[i]);
+    }
+
+    // the card's own sequence is used, so the device must not have one open
+    SdCard* card = reader->card;
+    if (!sd_block_dev_end_seq(sd_dev)) {
+        return false;
+    }
+    if ((!card->in_read_seq || card->seq_block != block)
+            && !sd_card_read_start(card, block)) {
+        return false;
+    }
+    if (!sd_async_read_data_seq(card, reader->buf[i], NULL)) {
+        return false;
+    }
+    reader->in_flight = 1;
+    return true;
+}
+
+
+// Start filling buf[i] with the block at the file's position. The position
+// only moves past the block once its read has started.
+SA_FUNC uint8_t sd_reader_fill(SdReader* reader, uint8_t i)
+{
+    SdFile* file = reader->file;
+    uint32_t left = file->file_size - file->cur_position;
+    reader->len[i] = left > 512 ? 512 : left;
+    if (reader->len[i] == 0) {
+        return true; // end of file
+    }
+
+    // sd_file_cur_block() may move on to the next cluster
+    const uint32_t cur_cluster = file->cur_cluster;
+    uint32_t block;
+    if (!sd_file_cur_block(file, &block)
+            || !sd_reader_read(reader, i, block)) {
+        file->cur_cluster = cur_cluster;
+        return false;
+    }
+    file->cur_position += reader->len[i];
+    return true;
+}
+
+
+/**
+ * Start reading a file from its current position, which must be a multiple of
+ * 512. The read of the first block is started. With a card it runs in the
+ * background, and the first sd_reader_next() waits for it.
+ *
+ * @param[in] file A file open for reading.
+ * @param[in] card The SD card under the file's volume, for background reads,
+ *   or NULL to read through the volume's block device in the foreground.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_reader_open(SdReader* reader, SdFile* file, SdCard* card)
+{
+    if (!sd_file_is_open(file) || !(file->flags & O_READ)
+            || (file->cur_position & 0x1FF)) {
+        return false;
+    }
+    reader->file = file;
+    reader->card = card;
+    reader->ready = 0;
+    reader->in_flight = 0;
+    return sd_reader_fill(reader, 0);
+}
+
+
+/**
+ * Get the next chunk of the file, and start reading the one after it. The
+ * chunk stays valid until the next call.
+ *
+ * @param[out] data Set to the chunk.
+ *
+ * @return The number of bytes in the chunk, 512 except at the end of the
+ *   file, zero at the end of the file, or -1 for an I/O error.
+ */
+SA_FUNC int16_t sd_reader_next(SdReader* reader, const uint8_t** data)
+{
+    if (reader->in_flight) {
+        reader->in_flight = 0;
+        if (!sd_async_wait()) {
+            return -1;
+        }
+    }
+    const uint8_t i = reader->ready;
+    if (reader->len[i] == 0) {
+        return 0;
+    }
+
+    // the caller is done with the other buffer
+    reader->ready = !i;
+    if (!sd_reader_fill(reader, !i)) {
+        return -1;
+    }
+    *data = reader->buf[i];
+    return reader->len[i];
+}
+
+
+/**
+ * Stop reading. The file's position is left after the last block read, which
+ * may be one block past the last chunk returned.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_reader_close(SdReader* reader)
+{
+    uint8_t ok = true;
+    if (reader->in_flight) {
+        reader->in_flight = 0;
+        ok = sd_async_wait();
+    }
+    if (reader->card && reader->card->in_read_seq) {
+        ok = sd_card_read_stop(reader->card) && ok;
+    }
+    return ok;
+}
+#endif//SD_READER_H
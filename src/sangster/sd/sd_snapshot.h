@@ -0,0 +1,219 @@
+#ifndef SD_SNAPSHOT_H
+#define SD_SNAPSHOT_H
+/*
+ * "libsangster_avr" is a library of common AVR functionality.
+ * Copyright (C) 2018  Jon Sangster
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+/**
+ * @file
+ *
+ * A snapshot of a mounted card in EEPROM, for a faster mount after a power
+ * cycle. sd_begin() uses it when SD_SNAPSHOT is defined.
+ *
+ * A cold mount calibrates the SPI clock with several verification reads, then
+ * reads the MBR, the FAT boot sector and, on FAT32, the FSINFO sector. A warm
+ * mount with sd_snapshot_mount() reads only the card's CID and the boot
+ * sector, checks both against the snapshot, then restores the SPI rate, the
+ * volume geometry and the allocation hint. The card must still be initialized
+ * with sd_card_init() first.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include "sangster/api.h"
+#include "sangster/sd/sd_card.h"
+#include "sangster/sd/sd_crc.h"
+#include "sangster/sd/sd_volume.h"
+
+
+/*******************************************************************************
+ * Definitions
+ ******************************************************************************/
+/** Changed whenever the layout of SdSnapshot changes */
+#define SD_SNAPSHOT_MAGIC 0x5D01
+
+
+/*******************************************************************************
+ * Types
+ ******************************************************************************/
+typedef struct sd_snapshot SdSnapshot;
+struct sd_snapshot
+{
+    uint16_t magic;       // SD_SNAPSHOT_MAGIC
+    SdCid cid;            // card the snapshot was taken of
+    uint8_t sck_rate_id;  // calibrated SPI rate
+    uint16_t boot_crc;    // CRC16 of the FAT boot sector
+
+    // SdVolume geometry, see sd_volume_init()
+    uint32_t boot_block;
+    uint8_t blocks_per_cluster;
+    uint32_t blocks_per_fat;
+    uint32_t cluster_count;
+    uint8_t cluster_size_shift;
+    uint32_t data_start_block;
+    uint8_t fat_count;
+    uint32_t fat_start_block;
+    uint8_t fat_type;
+    uint16_t root_dir_entry_count;
+    uint32_t root_dir_start;
+    uint32_t fsinfo_block;
+    uint32_t alloc_search_start;
+
+    uint16_t crc;         // CRC16 of the fields above
+};
+
+
+/*******************************************************************************
+ * Global Data
+ ******************************************************************************/
+/** The snapshot in EEPROM */
+SdSnapshot EEMEM sd_snapshot_eeprom;
+
+
+/*******************************************************************************
+ * Function Definitions
+ ******************************************************************************/
+// CRC16 of the boot sector of @a vol
+SA_FUNC uint8_t sd_snapshot_boot_crc(SdVolume* vol, uint16_t* crc)
+{
+    SdCache* cache = sd_volume_cache_raw_block(vol->boot_block, CACHE_FOR_READ);
+    if (!cache) {
+        return false;
+    }
+    *crc = sd_crc16(cache->data, 512);
+    return true;
+}
+
+
+/**
+ * Save a snapshot of a mounted card. Only bytes that changed are written, so
+ * saving the same card again doesn't wear the EEPROM.
+ *
+ * @param[in] card The card, after sd_card_calibrate_sck_rate().
+ * @param[in] vol The volume mounted from @a card.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_snapshot_save(SdCard* card, SdVolume* vol)
+{
+    SdSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+
+    snap.magic = SD_SNAPSHOT_MAGIC;
+    if (!sd_card_read_cid(card, &snap.cid)
+            || !sd_snapshot_boot_crc(vol, &snap.boot_crc)) {
+        return false;
+    }
+    snap.sck_rate_id = card->sck_rate_id;
+
+    snap.boot_block = vol->boot_block;
+    snap.blocks_per_cluster = vol->blocks_per_cluster;
+    snap.blocks_per_fat = vol->blocks_per_fat;
+    snap.cluster_count = vol->cluster_count;
+    snap.cluster_size_shift = vol->cluster_size_shift;
+    snap.data_start_block = vol->data_start_block;
+    snap.fat_count = vol->fat_count;
+    snap.fat_start_block = vol->fat_start_block;
+    snap.fat_type = vol->fat_type;
+    snap.root_dir_entry_count = vol->root_dir_entry_count;
+    snap.root_dir_start = vol->root_dir_start;
+    snap.fsinfo_block = vol->fsinfo_block;
+    snap.alloc_search_start = vol->alloc_search_start;
+
+    snap.crc = sd_crc16((const uint8_t*) &snap, offsetof(SdSnapshot, crc));
+    eeprom_update_block(&snap, &sd_snapshot_eeprom, sizeof(snap));
+    return true;
+}
+
+
+/** Discard the snapshot, so that the next mount is a cold one. */
+SA_INLINE void sd_snapshot_clear(void)
+{
+    eeprom_update_word(&sd_snapshot_eeprom.magic, 0xFFFF);
+}
+
+
+/**
+ * Mount a volume from the snapshot. The snapshot is only used if @a card is
+ * the card it was taken of and the FAT boot sector hasn't changed.
+ *
+ * @param[in] card A card initialized with sd_card_init().
+ * @param[in] dev The block device of @a card. See sd_card_block_dev().
+ * @param[out] vol The volume to mount.
+ *
+ * @return The value one, true, is returned if the volume was mounted and the
+ *   value zero, false, is returned if there is no valid snapshot of this card
+ *   or an I/O error occurs. The caller should then mount it the slow way.
+ *   The SCK rate is then left as it was on entry.
+ */
+SA_FUNC uint8_t sd_snapshot_mount(SdCard* card, SdBlockDev* dev, SdVolume* vol)
+{
+    SdSnapshot snap;
+    eeprom_read_block(&snap, &sd_snapshot_eeprom, sizeof(snap));
+    if (snap.magic != SD_SNAPSHOT_MAGIC
+            || snap.crc != sd_crc16((const uint8_t*) &snap,
+                                    offsetof(SdSnapshot, crc))) {
+        return false;
+    }
+
+    SdCid cid;
+    if (!sd_card_read_cid(card, &cid)
+            || memcmp(&cid, &snap.cid, sizeof(cid)) != 0) {
+        return false;
+    }
+    // a bad clock may be why the boot sector doesn't match, so any failure
+    // from here puts back the rate sd_card_calibrate_sck_rate() starts from
+    const uint8_t sck_rate_id = card->sck_rate_id;
+    if (!sd_card_set_sck_rate(card, snap.sck_rate_id)) {
+        goto fail;
+    }
+
+    vol->boot_block = snap.boot_block;
+    vol->blocks_per_cluster = snap.blocks_per_cluster;
+    vol->blocks_per_fat = snap.blocks_per_fat;
+    vol->cluster_count = snap.cluster_count;
+    vol->cluster_size_shift = snap.cluster_size_shift;
+    vol->data_start_block = snap.data_start_block;
+    vol->fat_count = snap.fat_count;
+    vol->fat_start_block = snap.fat_start_block;
+    vol->fat_type = snap.fat_type;
+    vol->root_dir_entry_count = snap.root_dir_entry_count;
+    vol->root_dir_start = snap.root_dir_start;
+
+    // the boot sector is read at the restored rate, so this also checks it
+    uint16_t boot_crc;
+    sd_volume_cache_set_dev(dev);
+    if (!sd_snapshot_boot_crc(vol, &boot_crc) || boot_crc != snap.boot_crc) {
+        goto fail;
+    }
+
+    sd_volume_init_state(vol);
+    if (snap.fsinfo_block && !sd_volume_read_fsinfo(vol, snap.fsinfo_block)) {
+        goto fail;
+    }
+    if (snap.alloc_search_start >= 2
+            && snap.alloc_search_start <= vol->cluster_count + 1) {
+        vol->alloc_search_start = snap.alloc_search_start;
+    }
+    return true;
+
+fail:
+    sd_card_set_sck_rate(card, sck_rate_id);
+    return false;
+}
+#endif//SD_SNAPSHOT_H
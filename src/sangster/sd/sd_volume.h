@@ -35,9 +35,13 @@
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include "sangster/api.h"
 #include "sangster/sd/fat_structs.h"
-#include "sangster/sd/sd_card.h"
+#include "sangster/sd/sd_block_dev.h"
+#if defined(SD_CACHE_STATS) && defined(__AVR__)
+#include "sangster/usart.h"
+#endif
 
 // value for action argument in cache_raw_block to indicate read from cache
 #define CACHE_FOR_READ 0
@@ -45,6 +49,46 @@
 // value for action argument in cache_raw_block to indicate cache dirty
 #define CACHE_FOR_WRITE 1
 
+// action bit for cache_raw_block to indicate a FAT block
+#define CACHE_FAT 2
+
+/**
+ * Number of 512 byte blocks in the cache. Blocks are replaced least recently
+ * used first.
+ */
+#ifndef SD_CACHE_BLOCKS
+#define SD_CACHE_BLOCKS 1
+#endif
+
+/*
+ * Define SD_CACHE_FAT_SLOT to keep the first cache slot for FAT blocks, so
+ * that FAT lookups at cluster boundaries never evict directory or file data.
+ */
+#if defined(SD_CACHE_FAT_SLOT) && SD_CACHE_BLOCKS < 2
+#error "SD_CACHE_FAT_SLOT needs SD_CACHE_BLOCKS of at least 2"
+#endif
+
+/*
+ * Define SD_FAT_DIRTY_BLOCKS for sd_volume_defer_fat_mirror(). It's the number
+ * of changed FAT blocks remembered between syncs. When more change, the whole
+ * FAT is copied at the next sync instead.
+ */
+#if defined(SD_FAT_DIRTY_BLOCKS) \
+        && (SD_FAT_DIRTY_BLOCKS < 1 || SD_FAT_DIRTY_BLOCKS > 254)
+#error "SD_FAT_DIRTY_BLOCKS must be from 1 to 254"
+#endif
+
+/*
+ * Define SD_DIR_CACHE as the number of directory entry locations each volume
+ * remembers, to speed up sd_file_open(). See SdDirLookup and SdDirSummary.
+ */
+#ifdef SD_DIR_CACHE
+/** Number of bits in SdDirSummary::names, a power of two */
+#ifndef SD_DIR_NAME_BITS
+#define SD_DIR_NAME_BITS 256
+#endif
+#endif
+
 
 /**
  * @brief Cache for an SD data block
@@ -58,8 +102,36 @@ union sd_cache
     SdDir dir[16];       /** Used to access cached directory entries. */
     SdMbr mbr;           /** Used to access a cached MasterBoot Record. */
     SdFbs fbs;           /** Used to access to a cached FAT boot sector. */
+    SdFsInfo fsinfo;     /** Used to access a cached FAT32 FSINFO sector. */
 };
 
+#ifdef SD_DIR_CACHE
+/** Where sd_file_open() last found a name. */
+typedef struct sd_dir_lookup SdDirLookup;
+struct sd_dir_lookup
+{
+    uint32_t dir_cluster; // first cluster of the directory, 0 for FAT16 root
+    uint16_t name_hash;   // see sd_file_name_hash()
+    uint32_t dir_block;   // block of the entry, 0 if this lookup is unused
+    uint8_t dir_index;    // index of the entry in dir_block
+};
+
+/**
+ * What a full scan by sd_file_open() learned about one directory: a bit for
+ * the hash of each name in it, and where to look for a free entry. A name
+ * whose bit is clear can be created without scanning the directory again.
+ */
+typedef struct sd_dir_summary SdDirSummary;
+struct sd_dir_summary
+{
+    uint8_t valid;
+    uint32_t dir_cluster;   // first cluster of the directory, 0 for FAT16 root
+    uint32_t free_position; // where to start looking for a free entry
+    uint8_t names[SD_DIR_NAME_BITS / 8];
+};
+#endif
+
+
 typedef struct sd_volume SdVolume;
 struct sd_volume
 {
@@ -74,15 +146,67 @@ struct sd_volume
     uint8_t fat_type;               // volume type (12, 16, or 32)
     uint16_t root_dir_entry_count;  // number of entries in FAT16 root dir
     uint32_t root_dir_start;        // root start block for FAT16, cluster for FAT32
+    uint32_t boot_block;            // block of the FAT boot sector
+    uint32_t fsinfo_block;          // FAT32 FSINFO block, zero if none
+    uint32_t free_count;            // free clusters, FSINFO_UNKNOWN if unknown
+    uint8_t fsinfo_dirty;           // sd_volume_sync() will write FSINFO
+    uint8_t erase_free;             // sd_volume_free_chain() erases clusters
+#ifdef SD_FAT_DIRTY_BLOCKS
+    uint8_t defer_mirror;           // mirror FAT writes wait for sd_volume_sync()
+    uint8_t fat_dirty_count;        // entries of fat_dirty, more if it overflowed
+    uint32_t fat_dirty[SD_FAT_DIRTY_BLOCKS]; // FAT blocks needing a mirror write
+#endif
+#ifdef SD_DIR_CACHE
+    SdDirLookup dir_lookup[SD_DIR_CACHE]; // see sd_file_open()
+    uint8_t dir_lookup_next;              // lookup to replace next
+    SdDirSummary dir_summary;
+#endif
 };
 
 
+/** @brief One block of the block cache */
+typedef struct sd_cache_slot SdCacheSlot;
+struct sd_cache_slot
+{
+    SdCache buffer;        // 512 byte cache for a device block
+    uint32_t block_number; // Logical number of block in the slot
+    uint32_t mirror_block; // block number for mirror FAT
+    uint8_t dirty;         // cache_flush() will write block if true
+    uint16_t used;         // cache_tick when last used, for LRU
+};
+
+
+#ifdef SD_CACHE_STATS
+/** Counters kept by the block cache when built with SD_CACHE_STATS defined. */
+typedef struct sd_cache_stats SdCacheStats;
+struct sd_cache_stats
+{
+    uint32_t fat_hits;        // FAT blocks found in the cache
+    uint32_t fat_misses;      // FAT blocks read from the device
+    uint32_t data_hits;       // other blocks found in the cache
+    uint32_t data_misses;     // other blocks read from the device
+    uint32_t claims;          // blocks cached without reading them
+    uint32_t zero_fills;      // blocks claimed by sd_volume_cache_zero_block()
+    uint32_t writes;          // dirty blocks written back
+    uint32_t dirty_evictions; // writes made to free a slot for another block
+    uint32_t mirror_writes;   // blocks written to the mirror FATs
+};
+
+#define SD_CACHE_STAT(counter) (cache_stats.counter++)
+#else
+#define SD_CACHE_STAT(counter)
+#endif
+
+
 // raw block cache
-SdCache cache_buffer;         // 512 byte cache for device blocks
-uint32_t cache_block_number;  // Logical number of block in the cache
-SdCard* sd_card;              // sd_card object for cache
-uint8_t cache_dirty;          // cache_flush() will write block if true
-uint32_t cache_mirror_block;  // block number for mirror FAT
+SdCacheSlot cache_slots[SD_CACHE_BLOCKS];
+SdCacheSlot* cache_slot;      // most recently used slot
+SdCache* cache_buffer;        // data of cache_slot
+uint16_t cache_tick;          // LRU clock
+SdBlockDev* sd_dev;           // block device for cache
+#ifdef SD_CACHE_STATS
+SdCacheStats cache_stats;
+#endif
 
 
 SA_INLINE uint8_t sd_volume_is_eoc(SdVolume* vol, uint32_t cluster)
@@ -111,51 +235,293 @@ SA_INLINE uint32_t sd_volume_block_number(SdVolume* vol, uint32_t cluster,
 }
 
 
+// empty every cache slot, discarding any dirty data
+SA_FUNC void sd_volume_cache_init()
+{
+    for (uint8_t i = 0; i < SD_CACHE_BLOCKS; i++) {
+        cache_slots[i].block_number = 0xFFFFFFFF;
+        cache_slots[i].mirror_block = 0;
+        cache_slots[i].dirty = 0;
+        cache_slots[i].used = 0;
+    }
+    cache_slot = cache_slots;
+    cache_buffer = &cache_slot->buffer;
+    cache_tick = 0;
+}
+
+
+// make slot the most recently used, and the one cache_buffer points to
+SA_INLINE void sd_volume_cache_use(SdCacheSlot* slot)
+{
+    slot->used = ++cache_tick;
+    cache_slot = slot;
+    cache_buffer = &slot->buffer;
+}
+
+
 SA_INLINE void sd_volume_cache_set_dirty()
 {
-    cache_dirty |= CACHE_FOR_WRITE;
+    cache_slot->dirty = CACHE_FOR_WRITE;
 }
 
 
-SA_FUNC uint8_t sd_volume_cache_flush()
+// write a slot back to the device if it is dirty
+SA_FUNC uint8_t sd_volume_cache_flush_slot(SdCacheSlot* slot)
 {
-    if (cache_dirty) {
-        if (!sd_card_write_block(sd_card, cache_block_number, cache_buffer.data)) {
+    if (slot->dirty) {
+        if (!sd_block_dev_write_block(sd_dev, slot->block_number, slot->buffer.data)) {
             return false;
         }
+        SD_CACHE_STAT(writes);
         // mirror FAT tables
-        if (cache_mirror_block) {
-            if (!sd_card_write_block(sd_card, cache_mirror_block, cache_buffer.data)) {
+        if (slot->mirror_block) {
+            if (!sd_block_dev_write_block(sd_dev, slot->mirror_block, slot->buffer.data)) {
                 return false;
             }
-            cache_mirror_block = 0;
+            SD_CACHE_STAT(mirror_writes);
+            slot->mirror_block = 0;
         }
-        cache_dirty = 0;
+        slot->dirty = 0;
     }
     return true;
 }
 
 
-SA_FUNC uint8_t sd_volume_cache_raw_block(uint32_t block_number, uint8_t action)
+SA_FUNC uint8_t sd_volume_cache_flush()
 {
-    if (cache_block_number != block_number) {
-        if (!sd_volume_cache_flush()) {
+    for (uint8_t i = 0; i < SD_CACHE_BLOCKS; i++) {
+        if (!sd_volume_cache_flush_slot(&cache_slots[i])) {
             return false;
         }
-        if (!sd_card_read_block(sd_card, block_number, cache_buffer.data)) {
-            return false;
+    }
+    return true;
+}
+
+
+// return the slot holding block_number, or NULL if it is not cached
+SA_FUNC SdCacheSlot* sd_volume_cache_find(uint32_t block_number)
+{
+    for (uint8_t i = 0; i < SD_CACHE_BLOCKS; i++) {
+        if (cache_slots[i].block_number == block_number) {
+            return &cache_slots[i];
+        }
+    }
+    return NULL;
+}
+
+
+// drop any cached copies of blocks first_block to last_block without writing
+// them, for when the device blocks are overwritten or erased directly
+SA_FUNC void sd_volume_cache_invalidate(uint32_t first_block, uint32_t last_block)
+{
+    for (uint8_t i = 0; i < SD_CACHE_BLOCKS; i++) {
+        SdCacheSlot* slot = &cache_slots[i];
+        if (slot->block_number >= first_block && slot->block_number <= last_block) {
+            slot->block_number = 0xFFFFFFFF;
+            slot->mirror_block = 0;
+            slot->dirty = 0;
+        }
+    }
+}
+
+
+#ifdef SD_CACHE_STATS
+/** Zero the block cache counters. */
+SA_FUNC void sd_volume_cache_stats_reset()
+{
+    memset(&cache_stats, 0, sizeof(SdCacheStats));
+}
+
+
+#ifdef __AVR__
+/**
+ * Print the block cache counters over the USART. See usart_init().
+ */
+SA_FUNC void sd_volume_cache_stats_dump()
+{
+    usart_print("fat hit=");
+    usart_32(cache_stats.fat_hits);
+    usart_print(" miss=");
+    usart_32(cache_stats.fat_misses);
+    usart_print(" data hit=");
+    usart_32(cache_stats.data_hits);
+    usart_print(" miss=");
+    usart_32(cache_stats.data_misses);
+    usart_crlf();
+    usart_print("claim=");
+    usart_32(cache_stats.claims);
+    usart_print(" zero=");
+    usart_32(cache_stats.zero_fills);
+    usart_print(" write=");
+    usart_32(cache_stats.writes);
+    usart_print(" evict=");
+    usart_32(cache_stats.dirty_evictions);
+    usart_print(" mirror=");
+    usart_32(cache_stats.mirror_writes);
+    usart_crlf();
+}
+#endif
+#endif//SD_CACHE_STATS
+
+
+// choose the slot to replace: the FAT slot for FAT blocks if there is one,
+// otherwise the least recently used slot
+SA_FUNC SdCacheSlot* sd_volume_cache_victim(uint8_t action)
+{
+#ifdef SD_CACHE_FAT_SLOT
+    if (action & CACHE_FAT) {
+        return cache_slots;
+    }
+    uint8_t first = 1;
+#else
+    (void) action;
+    uint8_t first = 0;
+#endif
+    SdCacheSlot* victim = &cache_slots[first];
+    for (uint8_t i = first + 1; i < SD_CACHE_BLOCKS; i++) {
+        SdCacheSlot* slot = &cache_slots[i];
+        if ((uint16_t) (cache_tick - slot->used)
+                > (uint16_t) (cache_tick - victim->used)) {
+            victim = slot;
+        }
+    }
+    return victim;
+}
+
+
+// cache block_number to be completely overwritten, without reading it
+SA_FUNC SdCache* sd_volume_cache_claim_block(uint32_t block_number,
+                                            uint8_t action)
+{
+    SdCacheSlot* slot = sd_volume_cache_find(block_number);
+    if (!slot) {
+        slot = sd_volume_cache_victim(action);
+        if (slot->dirty) {
+            SD_CACHE_STAT(dirty_evictions);
+        }
+        if (!sd_volume_cache_flush_slot(slot)) {
+            return NULL;
+        }
+        slot->block_number = block_number;
+    }
+    SD_CACHE_STAT(claims);
+    slot->dirty |= action & CACHE_FOR_WRITE;
+    sd_volume_cache_use(slot);
+    return cache_buffer;
+}
+
+
+/**
+ * Cache a block. @a action is CACHE_FOR_READ or CACHE_FOR_WRITE, optionally
+ * with CACHE_FAT for a FAT block.
+ *
+ * @return The cached block, which is also left in cache_buffer, or NULL if an
+ *   I/O error occurs.
+ */
+SA_FUNC SdCache* sd_volume_cache_raw_block(uint32_t block_number, uint8_t action)
+{
+    SdCacheSlot* slot = sd_volume_cache_find(block_number);
+#ifdef SD_CACHE_STATS
+    if (action & CACHE_FAT) {
+        if (slot) {
+            SD_CACHE_STAT(fat_hits);
+        } else {
+            SD_CACHE_STAT(fat_misses);
+        }
+    } else if (slot) {
+        SD_CACHE_STAT(data_hits);
+    } else {
+        SD_CACHE_STAT(data_misses);
+    }
+#endif
+    if (!slot) {
+        slot = sd_volume_cache_victim(action);
+        if (slot->dirty) {
+            SD_CACHE_STAT(dirty_evictions);
+        }
+        if (!sd_volume_cache_flush_slot(slot)) {
+            return NULL;
+        }
+        if (!sd_block_dev_read_block(sd_dev, block_number, slot->buffer.data)) {
+            slot->block_number = 0xFFFFFFFF;
+            return NULL;
+        }
+        slot->block_number = block_number;
+    }
+    slot->dirty |= action & CACHE_FOR_WRITE;
+    sd_volume_cache_use(slot);
+    return cache_buffer;
+}
+
+
+/**
+ * Make @a dev the device of the block cache. The cache is emptied if it holds
+ * blocks of another device.
+ */
+SA_FUNC void sd_volume_cache_set_dev(SdBlockDev* dev)
+{
+    if (dev != sd_dev) {
+        sd_volume_cache_init();
+        sd_dev = dev;
+    }
+}
+
+
+/**
+ * Read the free cluster count and next free cluster hint from the FAT32
+ * FSINFO sector at @a block. Signatures that don't match leave both unknown.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for an I/O error.
+ */
+SA_FUNC uint8_t sd_volume_read_fsinfo(SdVolume* vol, uint32_t block)
+{
+    SdCache* cache = sd_volume_cache_raw_block(block, CACHE_FOR_READ);
+    if (!cache) {
+        return false;
+    }
+    SdFsInfo* fsinfo = &cache->fsinfo;
+    if (fsinfo->lead_signature == FSINFO_LEAD_SIG
+            && fsinfo->struct_signature == FSINFO_STRUCT_SIG) {
+        vol->fsinfo_block = block;
+        if (fsinfo->free_count <= vol->cluster_count) {
+            vol->free_count = fsinfo->free_count;
+        }
+        if (fsinfo->next_free >= 2
+                && fsinfo->next_free <= vol->cluster_count + 1) {
+            vol->alloc_search_start = fsinfo->next_free;
         }
-        cache_block_number = block_number;
     }
-    cache_dirty |= action;
     return true;
 }
 
 
+// Reset the state of a volume whose geometry has just been set
+SA_FUNC void sd_volume_init_state(SdVolume* vol)
+{
+    vol->alloc_search_start = 2;
+    vol->free_count = FSINFO_UNKNOWN;
+    vol->fsinfo_block = 0;
+    vol->fsinfo_dirty = 0;
+    vol->erase_free = 0;
+#ifdef SD_FAT_DIRTY_BLOCKS
+    vol->defer_mirror = 0;
+    vol->fat_dirty_count = 0;
+#endif
+
+#ifdef SD_DIR_CACHE
+    memset(vol->dir_lookup, 0, sizeof(vol->dir_lookup));
+    vol->dir_lookup_next = 0;
+    vol->dir_summary.valid = 0;
+#endif
+}
+
+
 /**
  * Initialize a FAT volume.
  *
- * @param[in] dev The SD card where the volume is located.
+ * @param[in] dev The block device where the volume is located. See
+ *   sd_card_block_dev().
  *
  * @param[in] part The partition to be used. Legal values for \a part are 1-4
  *   to use the corresponding partition on a device formatted with a MBR, Master
@@ -167,10 +533,11 @@ SA_FUNC uint8_t sd_volume_cache_raw_block(uint32_t block_number, uint8_t action)
  *   valid partition, not finding a valid FAT file system in the specified
  *   partition or an I/O error.
  */
-SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdCard* dev, uint8_t part)
+SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdBlockDev* dev, uint8_t part)
 {
     uint32_t volume_start_block = 0;
-    sd_card = dev;
+
+    sd_volume_cache_set_dev(dev);
     // if part == 0 assume super floppy with FAT boot sector in block zero
     // if part > 0 assume mbr volume with partition table
     if (part) {
@@ -180,7 +547,7 @@ SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdCard* dev, uint8_t part)
         if (!sd_volume_cache_raw_block(volume_start_block, CACHE_FOR_READ)) {
             return false;
         }
-        SdPart* p = &cache_buffer.mbr.part[part - 1];
+        SdPart* p = &cache_buffer->mbr.part[part - 1];
         if ((p->boot & 0x7F) !=0  ||
                 p->total_sectors < 100 ||
                 p->first_sector == 0) {
@@ -191,7 +558,7 @@ SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdCard* dev, uint8_t part)
     if (!sd_volume_cache_raw_block(volume_start_block, CACHE_FOR_READ)) {
         return false;
     }
-    SdBpb* bpb = &cache_buffer.fbs.bpb;
+    SdBpb* bpb = &cache_buffer->fbs.bpb;
     if (bpb->bytes_per_sector != 512 ||
             bpb->fat_count == 0 ||
             bpb->reserved_sector_count == 0 ||
@@ -203,7 +570,7 @@ SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdCard* dev, uint8_t part)
 
     // determine shift that is same as multiply by vol->blocks_per_cluster
     vol->cluster_size_shift = 0;
-    while (vol->blocks_per_cluster != _BV(vol->cluster_size_shift)) {
+    while (vol->blocks_per_cluster != (1 << vol->cluster_size_shift)) {
         // error if not power of 2
         if (vol->cluster_size_shift++ > 7) {
             return false;
@@ -243,11 +610,20 @@ SA_FUNC uint8_t sd_volume_init(SdVolume* vol, SdCard* dev, uint8_t part)
         vol->root_dir_start = bpb->fat32_root_cluster;
         vol->fat_type = 32;
     }
+
+    vol->boot_block = volume_start_block;
+    sd_volume_init_state(vol);
+
+    // free cluster hints from FSINFO
+    if (vol->fat_type == 32 && bpb->fat32_fs_info != 0
+            && bpb->fat32_fs_info < bpb->reserved_sector_count) {
+        return sd_volume_read_fsinfo(vol, volume_start_block + bpb->fat32_fs_info);
+    }
     return true;
 }
 
 
-SA_INLINE uint8_t sd_volume_init_try_both(SdVolume* vol, SdCard* dev)
+SA_INLINE uint8_t sd_volume_init_try_both(SdVolume* vol, SdBlockDev* dev)
 {
     return sd_volume_init(vol, dev, 1) ? true : sd_volume_init(vol, dev, 0);
 }
@@ -262,15 +638,14 @@ SA_FUNC uint8_t sd_volume_fat_get(SdVolume* vol, uint32_t cluster, uint32_t* val
     uint32_t lba = vol->fat_start_block;
     lba += vol->fat_type == 16 ? cluster >> 8 : cluster >> 7;
 
-    if (lba != cache_block_number) {
-        if (!sd_volume_cache_raw_block(lba, CACHE_FOR_READ)) {
-            return false;
-        }
+    SdCache* fat = sd_volume_cache_raw_block(lba, CACHE_FOR_READ | CACHE_FAT);
+    if (!fat) {
+        return false;
     }
     if (vol->fat_type == 16) {
-        *value = cache_buffer.fat16[cluster & 0xFF];
+        *value = fat->fat16[cluster & 0xFF];
     } else {
-        *value = cache_buffer.fat32[cluster & 0x7F] & FAT32MASK;
+        *value = fat->fat32[cluster & 0x7F] & FAT32MASK;
     }
     return true;
 }
@@ -291,22 +666,116 @@ SA_FUNC uint8_t sd_volume_chain_size(SdVolume* vol, uint32_t cluster, uint32_t*
 }
 
 
-// free a cluster chain
+// Note that FAT block @a lba, just written in the cache slot cache_slot, must
+// be copied to the mirror FATs
+SA_FUNC void sd_volume_fat_mirror(SdVolume* vol, uint32_t lba)
+{
+    if (vol->fat_count < 2) {
+        return;
+    }
+#ifdef SD_FAT_DIRTY_BLOCKS
+    if (vol->defer_mirror) {
+        if (vol->fat_dirty_count > SD_FAT_DIRTY_BLOCKS) {
+            return; // the whole FAT will be copied
+        }
+        for (uint8_t i = 0; i < vol->fat_dirty_count; i++) {
+            if (vol->fat_dirty[i] == lba) {
+                return;
+            }
+        }
+        if (vol->fat_dirty_count < SD_FAT_DIRTY_BLOCKS) {
+            vol->fat_dirty[vol->fat_dirty_count] = lba;
+        }
+        vol->fat_dirty_count++;
+        return;
+    }
+#endif
+    cache_slot->mirror_block = lba + vol->blocks_per_fat;
+}
+
+
+// Erase the data blocks of @a count clusters starting at @a cluster
+SA_FUNC uint8_t sd_volume_erase_clusters(SdVolume* vol, uint32_t cluster,
+                                         uint32_t count)
+{
+    const uint32_t first_block = sd_volume_cluster_start_block(vol, cluster);
+    const uint32_t last_block = first_block
+        + (count << vol->cluster_size_shift) - 1;
+
+    // the cache must not hold a copy of an erased block
+    sd_volume_cache_invalidate(first_block, last_block);
+    return sd_block_dev_erase(sd_dev, first_block, last_block);
+}
+
+
+/**
+ * Free a cluster chain. Entries are cleared a FAT block at a time, while the
+ * chain stays inside the cached block, so each FAT block is read and written
+ * once for a mostly contiguous chain. If sd_volume_erase_on_free() is set,
+ * each contiguous run of freed clusters is erased.
+ *
+ * @param[in] cluster The first cluster of the chain.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
 SA_FUNC uint8_t sd_volume_free_chain(SdVolume* vol, uint32_t cluster)
 {
-    vol->alloc_search_start = 2; // clear free cluster location
+    const uint8_t shift = vol->fat_type == 16 ? 8 : 7; // entries per FAT block
+
+    // freed clusters before the search start are the most likely free ones
+    if (cluster < vol->alloc_search_start) {
+        vol->alloc_search_start = cluster;
+    }
 
+    uint32_t run_bgn = cluster; // contiguous run of freed clusters
+    uint32_t run_count = 0;
     do {
-        uint32_t next;
-        if (!sd_volume_fat_get(vol, cluster, &next)) {
+        if (cluster < 2 || cluster > vol->cluster_count + 1) {
             return false;
         }
-        if (!sd_volume_fat_get(vol, cluster, 0)) { // free cluster
+        const uint32_t lba = vol->fat_start_block + (cluster >> shift);
+        SdCache* fat = sd_volume_cache_raw_block(lba, CACHE_FOR_WRITE | CACHE_FAT);
+        if (!fat) {
             return false;
         }
-        cluster = next;
+        sd_volume_fat_mirror(vol, lba);
+
+        // free clusters until the chain leaves this FAT block
+        uint32_t block_cluster;
+        do {
+            uint32_t next;
+            if (vol->fat_type == 16) {
+                next = fat->fat16[cluster & 0xFF];
+                fat->fat16[cluster & 0xFF] = 0;
+            } else {
+                next = fat->fat32[cluster & 0x7F] & FAT32MASK;
+                fat->fat32[cluster & 0x7F] = 0;
+            }
+            if (vol->free_count != FSINFO_UNKNOWN) {
+                vol->free_count++;
+            }
+
+            if (cluster == run_bgn + run_count) {
+                run_count++;
+            } else {
+                if (vol->erase_free
+                        && !sd_volume_erase_clusters(vol, run_bgn, run_count)) {
+                    return false;
+                }
+                run_bgn = cluster;
+                run_count = 1;
+            }
+            block_cluster = cluster >> shift;
+            cluster = next;
+        } while (!sd_volume_is_eoc(vol, cluster) && cluster >= 2
+                 && cluster >> shift == block_cluster);
     } while (!sd_volume_is_eoc(vol, cluster));
+    vol->fsinfo_dirty = 1;
 
+    if (vol->erase_free) {
+        return sd_volume_erase_clusters(vol, run_bgn, run_count);
+    }
     return true;
 }
 
@@ -327,23 +796,19 @@ SA_FUNC uint8_t sd_volume_fat_put(SdVolume* vol, uint32_t cluster, uint32_t valu
     uint32_t lba = vol->fat_start_block;
     lba += vol->fat_type == 16 ? cluster >> 8 : cluster >> 7;
 
-    if (lba != cache_block_number) {
-        if (!sd_volume_cache_raw_block(lba, CACHE_FOR_READ)) {
-            return false;
-        }
+    SdCache* fat = sd_volume_cache_raw_block(lba, CACHE_FOR_WRITE | CACHE_FAT);
+    if (!fat) {
+        return false;
     }
     // store entry
     if (vol->fat_type == 16) {
-        cache_buffer.fat16[cluster & 0xFF] = value;
+        fat->fat16[cluster & 0xFF] = value;
     } else {
-        cache_buffer.fat32[cluster & 0x7F] = value;
+        fat->fat32[cluster & 0x7F] = value;
     }
-    sd_volume_cache_set_dirty();
 
     // mirror second FAT
-    if (vol->fat_count > 1) {
-        cache_mirror_block = lba + vol->blocks_per_fat;
-    }
+    sd_volume_fat_mirror(vol, lba);
     return true;
 }
 
@@ -357,20 +822,126 @@ SA_FUNC inline uint8_t sd_volume_fat_put_eoc(SdVolume* vol, uint32_t cluster)
 // cache a zero block for blockNumber
 SA_FUNC uint8_t sd_volume_cache_zero_block(uint32_t block_number)
 {
-    if (!sd_volume_cache_flush()) {
+    SdCache* cache = sd_volume_cache_claim_block(block_number, CACHE_FOR_WRITE);
+    if (!cache) {
         return false;
     }
+    SD_CACHE_STAT(zero_fills);
 
     // loop take less flash than memset(cacheBuffer_.data, 0, 512);
     for (uint16_t i = 0; i < 512; i++) {
-        cache_buffer.data[i] = 0;
+        cache->data[i] = 0;
     }
-    cache_block_number = block_number;
-    sd_volume_cache_set_dirty();
     return true;
 }
 
 
+// link a run of count clusters starting at bgn_cluster into a chain ending
+// in EOC. Entries are written in order, so each FAT block is cached once
+SA_FUNC uint8_t sd_volume_fat_link_run(SdVolume* vol, uint32_t bgn_cluster,
+                                       uint32_t count)
+{
+    const uint32_t end_cluster = bgn_cluster + count - 1;
+    for (uint32_t c = bgn_cluster; c < end_cluster; c++) {
+        if (!sd_volume_fat_put(vol, c, c + 1)) {
+            return false;
+        }
+    }
+    return sd_volume_fat_put_eoc(vol, end_cluster);
+}
+
+
+/**
+ * Search the FAT for @a count free clusters in a row. The search starts at
+ * cluster @a *start and wraps around to cluster 2 at the end of the FAT. Each
+ * cached FAT block is scanned as a whole, instead of fetching one entry at a
+ * time through sd_volume_fat_get().
+ *
+ * @param[in] count The number of clusters needed.
+ * @param[in,out] start The cluster to start searching at. On success, the
+ *   first cluster of the free run found.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned if there is no such run or on an I/O error.
+ */
+SA_FUNC uint8_t sd_volume_find_free_run(SdVolume* vol, uint32_t count,
+                                        uint32_t* start)
+{
+    const uint32_t fat_end = vol->cluster_count + 1; // last cluster of FAT
+    const uint8_t shift = vol->fat_type == 16 ? 8 : 7; // entries per FAT block
+
+    uint32_t cluster = *start; // next cluster to check
+    if (cluster < 2 || cluster > fat_end) {
+        cluster = 2;
+    }
+    uint32_t bgn = cluster;    // start of the free run
+    uint32_t unchecked = vol->cluster_count;
+
+    while (unchecked) {
+        // past end - start from beginning of FAT
+        if (cluster > fat_end) {
+            bgn = cluster = 2;
+        }
+        const uint32_t lba = vol->fat_start_block + (cluster >> shift);
+        SdCache* fat = sd_volume_cache_raw_block(lba, CACHE_FOR_READ | CACHE_FAT);
+        if (!fat) {
+            return false;
+        }
+
+        // entries to check in this block
+        uint16_t index = cluster & ((1 << shift) - 1);
+        uint32_t n = (1 << shift) - index;
+        if (n > fat_end - cluster + 1) {
+            n = fat_end - cluster + 1;
+        }
+        if (n > unchecked) {
+            n = unchecked;
+        }
+        unchecked -= n;
+
+        const uint16_t end = index + n;
+        const uint32_t base = cluster - index; // cluster of the block's entry 0
+        if (vol->fat_type == 16) {
+            const uint16_t* e = fat->fat16;
+            while (index < end) {
+                // skip clusters in use, the free run starts after them
+                if (e[index]) {
+                    do {
+                        index++;
+                    } while (index < end && e[index]);
+                    bgn = base + index;
+                }
+                // extend the free run
+                while (index < end && !e[index]) {
+                    if (base + ++index - bgn == count) {
+                        *start = bgn;
+                        return true;
+                    }
+                }
+            }
+        } else {
+            const uint32_t* e = fat->fat32;
+            while (index < end) {
+                if (e[index] & FAT32MASK) {
+                    do {
+                        index++;
+                    } while (index < end && (e[index] & FAT32MASK));
+                    bgn = base + index;
+                }
+                while (index < end && !(e[index] & FAT32MASK)) {
+                    if (base + ++index - bgn == count) {
+                        *start = bgn;
+                        return true;
+                    }
+                }
+            }
+        }
+        cluster += n;
+    }
+    return false;
+}
+
+
 // find a contiguous group of clusters
 SA_FUNC uint8_t sd_volume_alloc_contiguous(SdVolume* vol, uint32_t count,
                                           uint32_t* cur_cluster)
@@ -393,43 +964,12 @@ SA_FUNC uint8_t sd_volume_alloc_contiguous(SdVolume* vol, uint32_t count,
         set_start = 1 == count;
     }
 
-    uint32_t end_cluster = bgn_cluster;        // end of group
-    uint32_t fat_end = vol->cluster_count + 1; // last cluster of FAT
-
-    // search the FAT for free clusters
-    for (uint32_t n = 0;; n++, end_cluster++) {
-        // can't find space checked all clusters
-        if (n >= vol->cluster_count) {
-            return false;
-        }
-
-        // past end - start from beginning of FAT
-        if (end_cluster > fat_end) {
-            bgn_cluster = end_cluster = 2;
-        }
-        uint32_t f;
-        if (!sd_volume_fat_get(vol, end_cluster, &f)) {
-            return false;
-        }
-
-        if (f != 0) {
-            // cluster in use try next cluster as bgnCluster
-            bgn_cluster = end_cluster + 1;
-        } else if ((end_cluster - bgn_cluster + 1) == count) {
-            break; // done - found space
-        }
-    }
-    // mark end of chain
-    if (!sd_volume_fat_put_eoc(vol, end_cluster)) {
+    if (!sd_volume_find_free_run(vol, count, &bgn_cluster)) {
         return false;
     }
-
     // link clusters
-    while (end_cluster > bgn_cluster) {
-        if (!sd_volume_fat_put(vol, end_cluster - 1, end_cluster)) {
-            return false;
-        }
-        end_cluster--;
+    if (!sd_volume_fat_link_run(vol, bgn_cluster, count)) {
+        return false;
     }
     if (*cur_cluster != 0) {
         // connect chains
@@ -444,7 +984,129 @@ SA_FUNC uint8_t sd_volume_alloc_contiguous(SdVolume* vol, uint32_t count,
     if (set_start) {
         vol->alloc_search_start = bgn_cluster + 1;
     }
+    if (vol->free_count != FSINFO_UNKNOWN) {
+        vol->free_count -= count;
+    }
+    vol->fsinfo_dirty = 1;
+
+    return true;
+}
+
+
+/**
+ * Write the free cluster count and next free cluster hint to the FAT32 FSINFO
+ * sector, if they changed since the last write.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_volume_write_fsinfo(SdVolume* vol)
+{
+    if (!vol->fsinfo_dirty || !vol->fsinfo_block) {
+        return true;
+    }
+    SdCache* cache = sd_volume_cache_raw_block(vol->fsinfo_block, CACHE_FOR_WRITE);
+    if (!cache) {
+        return false;
+    }
+    cache->fsinfo.free_count = vol->free_count;
+    cache->fsinfo.next_free = vol->alloc_search_start;
+    vol->fsinfo_dirty = 0;
+    return true;
+}
+
+
+#ifdef SD_FAT_DIRTY_BLOCKS
+// Copy FAT block @a lba of the first FAT to the mirror FATs
+SA_FUNC uint8_t sd_volume_fat_copy(SdVolume* vol, uint32_t lba)
+{
+    SdCache* fat = sd_volume_cache_raw_block(lba, CACHE_FOR_READ | CACHE_FAT);
+    if (!fat) {
+        return false;
+    }
+    for (uint8_t i = 1; i < vol->fat_count; i++) {
+        if (!sd_block_dev_write_block(sd_dev, lba + i * vol->blocks_per_fat,
+                                      fat->data)) {
+            return false;
+        }
+        SD_CACHE_STAT(mirror_writes);
+    }
+    return true;
+}
+#endif
+
+
+/**
+ * Write all cached blocks and the FSINFO sector. If mirror FAT writes are
+ * deferred, the FAT blocks changed since the last sync are then copied to the
+ * mirror FATs.
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned for failure.
+ */
+SA_FUNC uint8_t sd_volume_sync(SdVolume* vol)
+{
+    if (!sd_volume_write_fsinfo(vol) || !sd_volume_cache_flush()) {
+        return false;
+    }
+
+#ifdef SD_FAT_DIRTY_BLOCKS
+    if (vol->fat_dirty_count > SD_FAT_DIRTY_BLOCKS) {
+        // too many changed blocks were noted, so copy them all
+        for (uint32_t offset = 0; offset < vol->blocks_per_fat; offset++) {
+            if (!sd_volume_fat_copy(vol, vol->fat_start_block + offset)) {
+                return false;
+            }
+        }
+    } else {
+        for (uint8_t i = 0; i < vol->fat_dirty_count; i++) {
+            if (!sd_volume_fat_copy(vol, vol->fat_dirty[i])) {
+                return false;
+            }
+        }
+    }
+    vol->fat_dirty_count = 0;
+#endif
+    return true;
+}
+
 
+#ifdef SD_FAT_DIRTY_BLOCKS
+/**
+ * Defer mirror FAT writes. Define SD_FAT_DIRTY_BLOCKS for this.
+ *
+ * Normally a FAT block's mirror copies are written each time the block is
+ * written back from the cache. When deferred, the changed FAT blocks are only
+ * noted, and their mirror copies are written once each by sd_volume_sync(),
+ * which sd_file_sync() calls. This saves mirror writes when FAT blocks are
+ * written back several times between syncs, e.g. evicted by file data with a
+ * small cache. It saves nothing if the file is synced after every write.
+ *
+ * @param[in] value The value TRUE (non-zero) or FALSE (zero).
+ *
+ * @return The value one, true, is returned for success and the value zero,
+ *   false, is returned if the mirror FATs could not be brought up to date when
+ *   turning deferral off.
+ */
+SA_FUNC uint8_t sd_volume_defer_fat_mirror(SdVolume* vol, uint8_t value)
+{
+    if (!value && !sd_volume_sync(vol)) {
+        return false;
+    }
+    vol->defer_mirror = value;
     return true;
 }
+#endif
+
+
+/**
+ * Erase clusters as sd_volume_free_chain() frees them, which makes later
+ * writes to them faster on most cards. Removing a file takes longer.
+ *
+ * @param[in] value The value TRUE (non-zero) or FALSE (zero).
+ */
+SA_INLINE void sd_volume_erase_on_free(SdVolume* vol, uint8_t value)
+{
+    vol->erase_free = value;
+}
 #endif//SD_VOLUME_H